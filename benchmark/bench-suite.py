@@ -100,8 +100,57 @@ def run_suite(processes_from, processes_to, processes_step ,fibers_from, fibers_
     
     print_m(res_matrix)  
 
+def parse_switch_time(out):
+    switch_time_found = re.search(r"Time per switch \(ns\):[0-9 ^\.]*\.[0-9]*", str(out))
+    if switch_time_found == None:
+        return 0.0
+    return float(switch_time_found.group(0).split(":")[1].strip())
+
+def do_switch_bench(num_fibers, silent=True):
+    out = subprocess.check_output(["./micro/switch", str(num_fibers)])
+    switch_time = parse_switch_time(out)
+    if switch_time == 0.0:
+        print("Switch bench (%d) has no time line!" % num_fibers)
+        return 0.0
+    if not silent:
+        print("With %d fibers a switch takes %f ns" % (num_fibers, switch_time))
+    return switch_time
+
+def run_switch_suite(fibers_from, fibers_to):
+    # the number of fibers grows by a factor of 10 at each step
+    f_n = fibers_from
+    while f_n <= fibers_to:
+        do_switch_bench(f_n, False)
+        f_n *= 10
+
+def do_scaling_bench(num_process, num_fibers):
+    # every process switches on its own, so the aggregate rate should grow with the processes
+    processes = []
+    for i in range(num_process):
+        processes.append(subprocess.Popen(["./micro/switch", str(num_fibers)], stdout=subprocess.PIPE))
+    switch_times = [parse_switch_time(p.communicate()[0]) for p in processes]
+    rate = sum([1000.0 / t for t in switch_times if t > 0.0])
+    print("With %d processes: %f Mswitch/s in total" % (num_process, rate))
+    return rate
+
+def run_scaling_suite(processes_to, num_fibers):
+    rates = []
+    for pr_n in range(1, processes_to + 1):
+        rates.append(do_scaling_bench(pr_n, num_fibers))
+    print()
+    for pr_n in range(1, processes_to + 1):
+        print("%d processes: speedup %3.3f" % (pr_n, rates[pr_n - 1] / rates[0] if rates[0] > 0 else 0))
+
 if __name__ == "__main__":
-    if len(sys.argv) == 7:
+    if len(sys.argv) >= 2 and sys.argv[1] == "switch":
+        fibers_from = int(sys.argv[2]) if len(sys.argv) > 2 else 10
+        fibers_to = int(sys.argv[3]) if len(sys.argv) > 3 else 1000000
+        run_switch_suite(fibers_from, fibers_to)
+    elif len(sys.argv) >= 2 and sys.argv[1] == "scaling":
+        processes_to = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+        num_fibers = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+        run_scaling_suite(processes_to, num_fibers)
+    elif len(sys.argv) == 7:
         num_processes_from = int(sys.argv[1])
         num_processes_to = int(sys.argv[2])
         processes_step = int(sys.argv[3])
@@ -118,3 +167,5 @@ if __name__ == "__main__":
     else:
         print("Usage: python bench-suite.py <num_processes> <num_fibers>")
         print("Usage: python bench-suite.py <num_processes_from> <num_processes_to> <processes_step> <num_fibers_from> <num_fibers_to> <fibers_step>")
+        print("Usage: python bench-suite.py switch [<num_fibers_from> <num_fibers_to>]")
+        print("Usage: python bench-suite.py scaling [<num_processes_to> <num_fibers>]")
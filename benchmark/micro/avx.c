@@ -0,0 +1,127 @@
+// Switch cost and correctness with the AVX registers in use.
+//
+// Usage: ./avx [rounds] [dirty]
+//
+// The main fiber ping-pongs with another fiber, each of them loads its own
+// value in ymm8 and ymm15 right before the switch and stores them right
+// after it, in the same asm block of the system call, so that no code that
+// may use the registers runs in between and the whole 256 bits of the
+// registers must be switched by the module. The switches are done with the
+// ioctl on the device opened by the library, since the calling convention
+// does not preserve the ymm registers across a call to SwitchToFiber().
+// With [dirty] set to 0 the registers are not used, for comparing the cost
+// of a switch with the AVX state in its init state. The output is the
+// average cost of a single switch and the number of times that a fiber
+// found a value that is not its own.
+
+#include <dirent.h>
+#include <immintrin.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
+
+static int main_fid, pong_fid;
+static int dev_fd;
+static int dirty;
+static long rounds, errors;
+
+// The file of the device that the library opened on the conversion, the
+// domain of the fibers is bound to it.
+static int find_device(void) {
+	char path[300], target[64];
+	struct dirent *entry;
+	DIR *dir = opendir("/proc/self/fd");
+	ssize_t len;
+	int fd = -1;
+
+	if(dir == NULL)
+		return -1;
+	while(fd < 0 && (entry = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+		len = readlink(path, target, sizeof(target) - 1);
+		if(len < 0)
+			continue;
+		target[len] = '\0';
+		if(strcmp(target, "/dev/fiber") == 0)
+			fd = atoi(entry->d_name);
+	}
+	closedir(dir);
+	return fd;
+}
+
+// Switch to fid with v in ymm8 and ymm15, and check them once back.
+__attribute__((target("avx2")))
+static void switch_with_ymm(int fid, double v) {
+	__m256d in = _mm256_set1_pd(v), a, b, eq;
+	double out[8];
+	long ret = SYS_ioctl;
+
+	if(!dirty) {
+		ioctl(dev_fd, FIBER_IOC_SWITCHTOFIBER, (unsigned long)fid);
+		return;
+	}
+	asm volatile("vmovupd %[in], %%ymm8\n\t"
+		     "vmovupd %[in], %%ymm15\n\t"
+		     "syscall\n\t"
+		     "vmovupd %%ymm8, %[a]\n\t"
+		     "vmovupd %%ymm15, %[b]"
+		     : "+a"(ret), [a] "=m"(out[0]), [b] "=m"(out[4])
+		     : "D"((long)dev_fd), "S"((long)FIBER_IOC_SWITCHTOFIBER),
+		       "d"((long)fid), [in] "m"(in)
+		     : "rcx", "r11", "xmm8", "xmm15", "memory");
+	if(ret < 0) {
+		fprintf(stderr, "Cannot switch to the fiber %d\n", fid);
+		exit(EXIT_FAILURE);
+	}
+	a = _mm256_loadu_pd(&out[0]);
+	b = _mm256_loadu_pd(&out[4]);
+	eq = _mm256_and_pd(_mm256_cmp_pd(a, in, _CMP_EQ_OQ),
+			   _mm256_cmp_pd(b, in, _CMP_EQ_OQ));
+	if(_mm256_movemask_pd(eq) != 0xf)
+		errors++;
+}
+
+static void *pong(void *args) {
+	(void)args;
+	while(1)
+		switch_with_ymm(main_fid, 2.0);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long i;
+	unsigned long long start, elapsed;
+
+	rounds = arg_or(argc, argv, 1, 1000000);
+	dirty = arg_or(argc, argv, 2, 1);
+	if(!__builtin_cpu_supports("avx2")) {
+		fprintf(stderr, "AVX2 is not supported\n");
+		exit(EXIT_FAILURE);
+	}
+	main_fid = ConvertThreadToFiber();
+	if(main_fid < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	pong_fid = CreateFiber(BENCH_STACK_SIZE, pong, NULL);
+	if(pong_fid < 0) {
+		fprintf(stderr, "Cannot create the fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	dev_fd = find_device();
+	if(dev_fd < 0) {
+		fprintf(stderr, "Cannot find the device\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+	for(i = 0; i < rounds; i++)
+		switch_with_ymm(pong_fid, 1.0);
+	elapsed = now_ns() - start;
+
+	printf("Time per switch (ns): %f\n", (double)elapsed / (2 * rounds));
+	printf("Wrong AVX registers: %ld\n", errors);
+	exit(errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../library/include/fiber.h"
+
+// Stack of the fibers created by the microbenchmarks, they only call the library
+#define BENCH_STACK_SIZE (4096 * 2)
+
+static inline unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline long arg_or(int argc, char **argv, int i, long def) {
+	if(argc > i)
+		return strtol(argv[i], NULL, 10);
+	return def;
+}
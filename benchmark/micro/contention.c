@@ -0,0 +1,108 @@
+// Cost of a switch when several threads compete for the same fibers.
+//
+// Usage: ./contention <num_threads> <num_fibers> [any] [switches]
+//
+// <num_threads> threads, the main one included, are converted to fibers
+// and then keep switching among all the fibers of the process until
+// <switches> switches succeeded. With [any] set to 0 every switch goes to a
+// random fiber and fails if the fiber is already running, with [any] set to
+// 1 the module picks an idle fiber with SwitchToAnyFiber(). The output is the
+// average cost of a successful switch and the number of failed ones.
+
+#include <pthread.h>
+#include <unistd.h>
+#include "common.h"
+
+static int *fids;
+static long num_fids;
+static int any;
+static long target;
+static volatile long switches, failures, ready_threads;
+static volatile int started;
+static __thread int is_main;
+static unsigned long long start;
+
+static void hop(void) {
+	unsigned seed = (unsigned long)&seed;
+	int ret;
+
+	while(switches < target) {
+		if(any)
+			ret = SwitchToAnyFiber();
+		else
+			ret = SwitchToFiber(fids[rand_r(&seed) % num_fids]);
+		if(ret < 0)
+			__sync_fetch_and_add(&failures, 1);
+		else
+			__sync_fetch_and_add(&switches, 1);
+	}
+	if(!is_main) {
+		while(1)
+			pause();
+	}
+	printf("Switches: %ld, failed: %ld\n", switches, failures);
+	printf("Time per switch (ns): %f\n", (double)(now_ns() - start) / switches);
+	exit(EXIT_SUCCESS);
+}
+
+static void *fiber_function(void *args) {
+	(void)args;
+	hop();
+	return NULL;
+}
+
+static void *thread_function(void *args) {
+	long i = (long)args;
+
+	fids[i] = ConvertThreadToFiber();
+	if(fids[i] < 0) {
+		fprintf(stderr, "Cannot convert thread #%ld to a fiber\n", i);
+		exit(EXIT_FAILURE);
+	}
+	__sync_fetch_and_add(&ready_threads, 1);
+	while(!started);
+	hop();
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long num_threads = arg_or(argc, argv, 1, 4);
+	long num_fibers = arg_or(argc, argv, 2, 64);
+	pthread_t thread;
+	long i;
+
+	any = arg_or(argc, argv, 3, 0);
+	target = arg_or(argc, argv, 4, 1000000);
+	num_fids = num_threads + num_fibers;
+	fids = malloc(num_fids * sizeof(int));
+	if(fids == NULL) {
+		fprintf(stderr, "Cannot allocate the ids\n");
+		exit(EXIT_FAILURE);
+	}
+
+	is_main = 1;
+	fids[0] = ConvertThreadToFiber();
+	if(fids[0] < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 1; i < num_threads; i++) {
+		if(pthread_create(&thread, NULL, thread_function, (void *)i) != 0) {
+			fprintf(stderr, "Cannot create thread #%ld\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = num_threads; i < num_fids; i++) {
+		fids[i] = CreateFiber(BENCH_STACK_SIZE, fiber_function, NULL);
+		if(fids[i] < 0) {
+			fprintf(stderr, "Cannot create fiber #%ld\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	while(ready_threads < num_threads - 1);
+
+	start = now_ns();
+	started = 1;
+	hop();
+	return 0;
+}
@@ -0,0 +1,51 @@
+// Cost of the creation of fibers, one call at a time or in a batch.
+//
+// Usage: ./create [fibers] [batched]
+//
+// The main fiber creates <fibers> fibers, with one CreateFiber() each or, if
+// <batched> is 1, with a single CreateFibers(). The output is the average
+// cost of the creation of a fiber.
+
+#include "common.h"
+
+static void *fiber_function(void *args) {
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long fibers = arg_or(argc, argv, 1, 50000);
+	long batched = arg_or(argc, argv, 2, 0);
+	long i, created = 0;
+	unsigned long long start, elapsed;
+	int *fids;
+
+	fids = malloc(fibers * sizeof(int));
+	if(fids == NULL) {
+		fprintf(stderr, "Cannot allocate the ids\n");
+		exit(EXIT_FAILURE);
+	}
+	if(ConvertThreadToFiber() < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+	if(batched) {
+		created = CreateFibers(fibers, BENCH_STACK_SIZE, fiber_function, NULL, fids);
+	} else {
+		for(i = 0; i < fibers; i++) {
+			fids[i] = CreateFiber(BENCH_STACK_SIZE, fiber_function, NULL);
+			if(fids[i] < 0)
+				break;
+			created++;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	if(created != fibers) {
+		fprintf(stderr, "Created only %ld fibers out of %ld\n", created, fibers);
+		exit(EXIT_FAILURE);
+	}
+	printf("Time per fiber creation (ns): %f\n", (double)elapsed / fibers);
+	exit(EXIT_SUCCESS);
+}
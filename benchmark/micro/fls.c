@@ -0,0 +1,39 @@
+// Cost of an access to the fiber local storage.
+//
+// Usage: ./fls [rounds]
+//
+// The main fiber allocates a cell of its local storage, then it sets and
+// reads it back <rounds> times. The output is the average cost of a single
+// FlsSetValue() plus FlsGetValue() pair.
+
+#include "common.h"
+
+int main(int argc, char **argv) {
+	long rounds = arg_or(argc, argv, 1, 1000000);
+	long i, idx, sum = 0;
+	unsigned long long start, elapsed;
+
+	if(ConvertThreadToFiber() < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	idx = FlsAlloc();
+	if(idx < 0) {
+		fprintf(stderr, "Cannot allocate a local storage cell\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+	for(i = 0; i < rounds; i++) {
+		FlsSetValue(idx, i);
+		sum += FlsGetValue(idx);
+	}
+	elapsed = now_ns() - start;
+
+	if(sum != rounds * (rounds - 1) / 2) {
+		fprintf(stderr, "Wrong values read from the local storage\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Time per set and get (ns): %f\n", (double)elapsed / rounds);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,57 @@
+// Switch cost between fibers that do not use the FPU.
+//
+// Usage: ./nofpu [rounds] [nofpu]
+//
+// Two fibers are created, with FIBER_FLAG_NOFPU if [nofpu] is 1, and they
+// ping-pong <rounds> times, so that neither side of the switches is the
+// converted main fiber. Run it with [nofpu] set to 0 and 1 for comparing
+// the cost of a single SwitchToFiber() with and without the FPU state.
+
+#include "common.h"
+
+static int ping_fid, pong_fid;
+static long rounds;
+
+static void *pong(void *args) {
+	(void)args;
+	while(1)
+		SwitchToFiber(ping_fid);
+	return NULL;
+}
+
+static void *ping(void *args) {
+	unsigned long long start, elapsed;
+	long i;
+	(void)args;
+
+	// warm up
+	for(i = 0; i < rounds / 10; i++)
+		SwitchToFiber(pong_fid);
+
+	start = now_ns();
+	for(i = 0; i < rounds; i++)
+		SwitchToFiber(pong_fid);
+	elapsed = now_ns() - start;
+
+	printf("Time per switch (ns): %f\n", (double)elapsed / (2 * rounds));
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+	unsigned long flags;
+
+	rounds = arg_or(argc, argv, 1, 1000000);
+	flags = arg_or(argc, argv, 2, 1) ? FIBER_FLAG_NOFPU : 0;
+	if(ConvertThreadToFiber() < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	ping_fid = CreateFiberEx(BENCH_STACK_SIZE, ping, NULL, flags);
+	pong_fid = CreateFiberEx(BENCH_STACK_SIZE, pong, NULL, flags);
+	if(ping_fid < 0 || pong_fid < 0) {
+		fprintf(stderr, "Cannot create the fibers\n");
+		exit(EXIT_FAILURE);
+	}
+	SwitchToFiber(ping_fid);
+	return 0;
+}
@@ -0,0 +1,58 @@
+// Switch latency as a function of the number of fibers of the process.
+//
+// Usage: ./switch <num_fibers> [rounds] [stats]
+//
+// The main fiber creates <num_fibers> fibers and then ping-pongs with the
+// last created one, which is the worst case for a lookup by list scan.
+// With [stats] the statistics of the fibers are collected at one switch
+// every [stats], or never if it is 0, instead of the default of the module.
+// The output is the average cost of a single SwitchToFiber().
+
+#include "common.h"
+
+static int main_fid;
+
+static void *pong(void *args) {
+	(void)args;
+	while(1)
+		SwitchToFiber(main_fid);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long num_fibers = arg_or(argc, argv, 1, 10);
+	long rounds = arg_or(argc, argv, 2, 100000);
+	long i;
+	int fid = -1;
+	unsigned long long start, elapsed;
+
+	main_fid = ConvertThreadToFiber();
+	if(main_fid < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	if(argc > 3 && SetFiberStatistics(arg_or(argc, argv, 3, 1)) < 0) {
+		fprintf(stderr, "Cannot set the statistics\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < num_fibers; i++) {
+		fid = CreateFiber(BENCH_STACK_SIZE, pong, NULL);
+		if(fid < 0) {
+			fprintf(stderr, "Cannot create fiber #%ld\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// warm up
+	for(i = 0; i < rounds / 10; i++)
+		SwitchToFiber(fid);
+
+	start = now_ns();
+	for(i = 0; i < rounds; i++)
+		SwitchToFiber(fid);
+	elapsed = now_ns() - start;
+
+	printf("Fibers: %ld\n", num_fibers);
+	printf("Time per switch (ns): %f\n", (double)elapsed / (2 * rounds));
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,64 @@
+// Cost of the exit of a thread, with or without fibers in the process.
+//
+// Usage: ./thread_churn <num_threads> [fibered] [processes]
+//
+// The process creates and joins <num_threads> threads that exit
+// immediately, so that the measured time is dominated by the creation and
+// the exit of the threads. With [fibered] set to 1 the main thread is
+// converted to a fiber before, so the process is known to the module.
+// With [processes] greater than 0 the same is repeated in that many forked
+// children at the same time, for putting the exit path under contention.
+// The output is the average cost of a thread in the calling process.
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+
+static void *nop(void *args) {
+	return args;
+}
+
+static double churn(long num_threads, int fibered) {
+	pthread_t thread;
+	unsigned long long start;
+	long i;
+
+	if(fibered && ConvertThreadToFiber() < 0) {
+		fprintf(stderr, "Cannot convert the thread to a fiber\n");
+		exit(EXIT_FAILURE);
+	}
+	start = now_ns();
+	for(i = 0; i < num_threads; i++) {
+		if(pthread_create(&thread, NULL, nop, NULL) != 0) {
+			fprintf(stderr, "Cannot create thread #%ld\n", i);
+			exit(EXIT_FAILURE);
+		}
+		pthread_join(thread, NULL);
+	}
+	return (double)(now_ns() - start) / num_threads;
+}
+
+int main(int argc, char **argv) {
+	long num_threads = arg_or(argc, argv, 1, 100000);
+	int fibered = arg_or(argc, argv, 2, 0);
+	long processes = arg_or(argc, argv, 3, 0);
+	long i;
+	double per_thread;
+
+	for(i = 0; i < processes; i++) {
+		if(fork() == 0) {
+			churn(num_threads, fibered);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	per_thread = churn(num_threads, fibered);
+	for(i = 0; i < processes; i++)
+		wait(NULL);
+
+	printf("Threads: %ld\n", num_threads);
+	printf("Fibered: %d\n", fibered);
+	printf("Processes: %ld\n", processes + 1);
+	printf("Time per thread (ns): %f\n", per_thread);
+	exit(EXIT_SUCCESS);
+}
@@ -20,19 +20,29 @@ static unsigned long long init_millis;
 static unsigned long long exec_millis;
 static volatile bool init_complete;
 
+#ifdef USERSPACE
 // Pick fibers randomly. This might return a fiber which is
 // currently scheduled on another thread.
 static int get_random_fiber(void) {
 	return random() % num_fibers;
 }
+#endif
+
+// Switch to a fiber which is not running. The module keeps a queue
+// of the idle fibers, the user space implementation picks one randomly.
+static void switch_to_another_fiber(void) {
+#ifdef USERSPACE
+	SwitchToFiber(fibers[get_random_fiber()]);
+#else
+	SwitchToAnyFiber();
+#endif
+}
 
 // Let's switch to another fiber!
 void schedule(int sig) {
 	(void)sig;
-	unsigned int f;
-	f = get_random_fiber();
 	alarm(1);
-	SwitchToFiber(fibers[f]);
+	switch_to_another_fiber();
 }
 
 // This is the code in which each processing fiber will leave.
@@ -117,7 +127,6 @@ static void main_loop(void *args) {
 // get back here!
 static void *thread_initialization(void *args) __attribute__ ((noreturn));
 static void *thread_initialization(void *args) {
-	unsigned int f;
 	(void)args;
 	
 	ConvertThreadToFiber();
@@ -125,8 +134,7 @@ static void *thread_initialization(void *args) {
 	while(!init_complete);
 	
 	while(true) {
-		f = get_random_fiber();
-		SwitchToFiber(fibers[f]);		
+		switch_to_another_fiber();
 	}
 }
 
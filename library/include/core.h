@@ -37,9 +37,11 @@
 #include "utils.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stropts.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
@@ -55,9 +57,52 @@
  */
 #define STACK_SIZE 2048 * 8
 
+/**
+ * @brief The number of fibers that a single chunk of the fibers table can index
+ *
+ */
+#define FIBERS_TABLE_CHUNK 4096
+/**
+ * @brief The number of chunks of the fibers table, so that all the fibers of the first domain of
+ * the process are indexed
+ *
+ */
+#define FIBERS_TABLE_CHUNKS (FIBER_MAX_FIBERS / FIBERS_TABLE_CHUNK)
+
+/**
+ * @brief The number of fibers whose local storage is mapped together, a chunk is mapped only when
+ * a fiber of it is created
+ *
+ */
+#define FLS_MAPPING_CHUNK 1024
+/**
+ * @brief The number of chunks of the mapping of the fiber local storage, one for every
+ * @ref FLS_MAPPING_CHUNK fibers of the domain
+ *
+ */
+#define FLS_MAPPING_CHUNKS (FIBER_MAX_FIBERS / FLS_MAPPING_CHUNK)
+/**
+ * @brief The size of a chunk of the mapping of the fiber local storage
+ *
+ */
+#define FLS_MAPPING_CHUNK_SIZE ((size_t)FLS_MAPPING_CHUNK * FLS_MAP_SIZE)
+
+typedef struct fiber fiber_t;
+
 void safe_cleanup();
 void clean_memory();
+void free_fiber_params(fiber_params_t *params);
+fiber_params_t *prepare_fiber_params(unsigned long stack_size, void *(*function)(void *),
+                                     void *args, unsigned long flags);
 int open_device();
+void reset_device();
+void map_fls(int dev_fd, unsigned fid);
+void unmap_fls();
+long *running_fls();
+int fls_is_allocated(long index);
+int index_fiber(fiber_t *fiber_node);
+void unindex_fiber(fiber_t *fiber_node);
+fiber_t *lookup_fiber(unsigned fid);
 
 void start(void) __attribute__((constructor));
 void end(void) __attribute__((destructor));
@@ -66,19 +111,26 @@ void end(void) __attribute__((destructor));
  * @brief Single node in a fiber_list_t list
  *
  */
-typedef struct fiber {
+struct fiber {
     unsigned id;
     fiber_params_t *params;
     struct list_head list;
-} __attribute__((aligned(16), packed)) fiber_t;
+} __attribute__((aligned(16), packed));
 
 /**
  * @brief A local list of fibers
  *
+ * Fibers are also indexed by id in a two-level table, so that @ref SwitchToFiber does not need to
+ * walk the list. Chunks of the table are allocated only when needed and never moved. The fibers
+ * are freed by @ref DeleteFiber, so the list and the table are only used holding
+ * fibers_list::lock, and a fiber is not used after the lock is released.
+ *
  */
 typedef struct fibers_list {
     struct list_head list;
+    fiber_t **table[FIBERS_TABLE_CHUNKS]; /**< Chunks of @ref FIBERS_TABLE_CHUNK fibers by slot */
     unsigned fibers_count;
+    pthread_mutex_t lock; /**< Protects list and table */
 } fibers_list_t;
 
 #endif
\ No newline at end of file
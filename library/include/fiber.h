@@ -31,11 +31,22 @@
 #ifndef __FIBER_H
 #define __FIBER_H
 
+#include "../../module/include/ioctlcmd.h"
 #include "common.h"
 
 int ConvertThreadToFiber();
 int CreateFiber(unsigned long stack_size, void *(*function)(void *), void *args);
+int CreateFiberEx(unsigned long stack_size, void *(*function)(void *), void *args,
+                  unsigned long flags);
+int CreateFibers(unsigned n, unsigned long stack_size, void *(*function)(void *), void **args,
+                 int *fids);
 int SwitchToFiber(unsigned fid);
+int DeleteFiber(unsigned fid);
+int SwitchToAnyFiber();
+int SetReadyQueuePolicy(int policy);
+int SetFiberStatistics(unsigned long period);
+int SetFiberPerfCounters(int enable);
+fiber_snapshot_t *GetFibersSnapshot(int pid, int *count);
 
 long FlsAlloc();
 int FlsFree(long);
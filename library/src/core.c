@@ -29,19 +29,43 @@
  */
 
 #include "core.h"
+#include <pthread.h>
 #include <semaphore.h>
 
 sem_t device_sem;
 
 int fiber_dev_fd = -1;
 
+/**
+ * @brief The mapping of the bitmap of the allocated indexes of the fiber local storage, NULL if the
+ * device cannot be mapped
+ *
+ */
+static unsigned long *fls_bitmap = NULL;
+
+/**
+ * @brief The mappings of the fiber local storage of the fibers, by chunks of
+ * @ref FLS_MAPPING_CHUNK fibers, NULL for the chunks that are not mapped
+ *
+ */
+static char *fls_chunks[FLS_MAPPING_CHUNKS];
+
+/**
+ * @brief The id of the fiber that the thread is running, -1 if the thread is not a fiber
+ *
+ * It is set just before the switch, since when the switch succeeds the thread continues in the
+ * requested fiber.
+ */
+static __thread long running_fid = -1;
+
 /*
  * Private member variables
  */
 // clang-format off
 static fibers_list_t fibers_list = {
     .list = LIST_HEAD_INIT(fibers_list.list),
-    .fibers_count = 0
+    .fibers_count = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER
 };
 // clang-format on
 
@@ -68,9 +92,14 @@ int ConvertThreadToFiber() {
     printf(LIBRARY_TAG CORE_TAG "ConvertThreadToFiber() assigned %d to fiber\n", ret);
 #endif
     // add new node to the list of fiber
+    pthread_mutex_lock(&fibers_list.lock);
     create_list_entry(fiber_node, &fibers_list.list, list, fiber_t);
     fiber_node->id = ret;
     fiber_node->params = NULL;
+    index_fiber(fiber_node);
+    pthread_mutex_unlock(&fibers_list.lock);
+    running_fid = ret;
+    map_fls(dev_fd, ret);
     return ret;
 }
 
@@ -91,27 +120,29 @@ int ConvertThreadToFiber() {
  * @return int
  */
 int CreateFiber(unsigned long stack_size, void *(*function)(void *), void *args) {
+    return CreateFiberEx(stack_size, function, args, 0);
+}
+
+/**
+ * @brief Create a Fiber object with the given flags
+ *
+ * As @ref CreateFiber, the flags are passed to the kernel in fiber_params::flags.
+ *
+ * @param stack_size
+ * @param function
+ * @param args
+ * @param flags FIBER_FLAG_NOFPU if the fiber never uses floating point or SIMD registers, so they
+ * are not switched when the thread switches to or from it
+ * @return int
+ */
+int CreateFiberEx(unsigned long stack_size, void *(*function)(void *), void *args,
+                  unsigned long flags) {
 #ifdef DEBUG
-    printf(LIBRARY_TAG CORE_TAG "CreateFiber()\n");
+    printf(LIBRARY_TAG CORE_TAG "CreateFiberEx(%lu)\n", flags);
 #endif
     fiber_t *fiber_node;
     // prepare the params
-    fiber_params_t *params = (fiber_params_t *)malloc(sizeof(fiber_params_t));
-    params->function = (unsigned long)function;
-    params->function_args = (unsigned long)args;
-    // params->stack_addr = (unsigned long)malloc(stack_size) + stack_size;
-    params->stack_addr = (unsigned long)aligned_alloc(16, stack_size) + stack_size;
-#ifdef DEBUG
-    printf("Is stack aligned: %d\n", params->stack_addr % 16 == 0);
-    printf("Stack addr is %lu\n", params->stack_addr);
-#endif
-    params->stack_size = stack_size;
-    // -> set the return address to the desired cleanup function,
-    //    return address is the first cell of the stack, this an implementation what the call
-    //    instruction should have done. The following two lines are equivalent to the push of the
-    //    ret address
-    ((unsigned long *)params->stack_addr)[0] = (unsigned long)&safe_cleanup;
-    params->stack_addr -= 8;
+    fiber_params_t *params = prepare_fiber_params(stack_size, function, args, flags);
 
     int dev_fd = open_device();
     if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
@@ -124,12 +155,81 @@ int CreateFiber(unsigned long stack_size, void *(*function)(void *), void *args)
     printf(LIBRARY_TAG CORE_TAG "CreateFiber() assigned %d to fiber\n", ret);
 #endif
     // add new node to the list of fiber
+    pthread_mutex_lock(&fibers_list.lock);
     create_list_entry(fiber_node, &fibers_list.list, list, fiber_t);
     fiber_node->id = ret;
     fiber_node->params = params;
+    index_fiber(fiber_node);
+    pthread_mutex_unlock(&fibers_list.lock);
+    map_fls(dev_fd, ret);
     return ret;
 }
 
+/**
+ * @brief Create several fibers with a single call to the device
+ *
+ * # Implementation
+ * The fibers are prepared as in @ref CreateFiber, then they are created by a batch of
+ * FIBER_BATCH_CREATE operations, see @ref FIBER_IOC_BATCH, so the cost of the call is paid once for
+ * all of them. The kernel stops at the first fiber that cannot be created, the following ones are
+ * not created and their stacks are released.
+ *
+ * @param n the number of fibers to create
+ * @param stack_size the size of the stack of every fiber
+ * @param function the starting function of every fiber
+ * @param args the argument of the function of every fiber, NULL for passing NULL to all of them
+ * @param fids filled with the ids of the fibers that have been created
+ * @return int the number of fibers created, that is less than @p n on error, or -1 if no fiber has
+ * been created
+ */
+int CreateFibers(unsigned n, unsigned long stack_size, void *(*function)(void *), void **args,
+                 int *fids) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "CreateFibers(%u)\n", n);
+#endif
+    fiber_t *fiber_node;
+    int created = 0;
+    if (n == 0) return 0;
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    fiber_batch_op_t *ops = (fiber_batch_op_t *)calloc(n, sizeof(fiber_batch_op_t));
+    fiber_params_t **params = (fiber_params_t **)calloc(n, sizeof(fiber_params_t *));
+    if (ops == NULL || params == NULL) {
+        free(ops);
+        free(params);
+        return -1;
+    }
+    // prepare the params
+    for (unsigned i = 0; i < n; i++) {
+        params[i] = prepare_fiber_params(stack_size, function, args == NULL ? NULL : args[i], 0);
+        ops[i].op = FIBER_BATCH_CREATE;
+        ops[i].ret = -1; // not touched by the kernel if the fiber is not created
+        ops[i].create = *params[i];
+    }
+    fiber_batch_params_t batch = {.ops = (unsigned long)ops, .count = n};
+    int ret = ioctl(dev_fd, FIBER_IOC_BATCH, (unsigned long)&batch);
+    if (ret < 0) printf(LIBRARY_TAG CORE_TAG "CreateFibers() ioctl error, errno %d\n", errno);
+    // add the new nodes to the list of fibers
+    pthread_mutex_lock(&fibers_list.lock);
+    for (unsigned i = 0; i < n; i++) {
+        if (ops[i].ret < 0) {
+            free((void *)(params[i]->stack_addr + 8 - stack_size));
+            free(params[i]);
+            continue;
+        }
+        create_list_entry(fiber_node, &fibers_list.list, list, fiber_t);
+        fiber_node->id = ops[i].ret;
+        fiber_node->params = params[i];
+        index_fiber(fiber_node);
+        fids[created++] = ops[i].ret;
+    }
+    pthread_mutex_unlock(&fibers_list.lock);
+    for (int i = 0; i < created; i++) map_fls(dev_fd, fids[i]);
+    free(ops);
+    free(params);
+    return created > 0 ? created : -1;
+}
+
 /**
  * @brief Switch to the passed fiber
  *
@@ -141,8 +241,10 @@ int SwitchToFiber(unsigned fid) {
     printf(LIBRARY_TAG CORE_TAG "SwitchToFiber(%u)\n", fid);
 #endif
     fiber_t *fiber_node;
-    // check if that fiber locally exists
-    check_if_exists(fiber_node, &fibers_list.list, id, fid, list, fiber_t);
+    // check if that fiber locally exists, the node is not used after the lock is released
+    pthread_mutex_lock(&fibers_list.lock);
+    fiber_node = lookup_fiber(fid);
+    pthread_mutex_unlock(&fibers_list.lock);
     if (fiber_node == NULL) {
         errno = ERR_FIBER_NOT_EXISTS;
         return -1;
@@ -150,14 +252,189 @@ int SwitchToFiber(unsigned fid) {
     // call ioctl
     int dev_fd = open_device();
     if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    long previous_fid = running_fid;
+    running_fid = fid;
     int ret = ioctl(dev_fd, FIBER_IOC_SWITCHTOFIBER, (unsigned long)fid);
     if (ret < 0) {
         // printf(LIBRARY_TAG CORE_TAG "SwitchToFiber() ioctl error, errno %d\n", errno);
+        running_fid = previous_fid;
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Delete a fiber of the process
+ *
+ * # Implementation
+ * The kernel refuses to delete a fiber that is running, included the one of the calling thread,
+ * then the stack and the params allocated by @ref CreateFiber are released. The fid can be given
+ * by the kernel to a new fiber with another generation, see @ref FIBER_FID_GEN, so the deleted
+ * id is not found anymore.
+ *
+ * The ioctl is done without holding fibers_list::lock. Only the thread whose ioctl succeeds frees
+ * the node, and it removes the node from the list and the table under the lock before freeing it,
+ * so a concurrent lookup never sees a freed node.
+ *
+ * @param fid
+ * @return int 0 if the fiber has been deleted, -1 otherwise, errno is ERR_FIBER_NOT_EXISTS if
+ * the fiber does not exist and ERR_FIBER_ALREADY_RUNNING if it is running
+ */
+int DeleteFiber(unsigned fid) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "DeleteFiber(%u)\n", fid);
+#endif
+    fiber_t *fiber_node;
+    // check if that fiber locally exists
+    pthread_mutex_lock(&fibers_list.lock);
+    fiber_node = lookup_fiber(fid);
+    pthread_mutex_unlock(&fibers_list.lock);
+    if (fiber_node == NULL) {
+        errno = ERR_FIBER_NOT_EXISTS;
+        return -1;
+    }
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    int ret = ioctl(dev_fd, FIBER_IOC_DELETE, (unsigned long)fid);
+    if (ret < 0) return -1;
+    // the node is ours, no other thread can delete the same fiber
+    pthread_mutex_lock(&fibers_list.lock);
+    unindex_fiber(fiber_node);
+    list_del(&fiber_node->list);
+    pthread_mutex_unlock(&fibers_list.lock);
+    if (fiber_node->params != NULL) free_fiber_params(fiber_node->params);
+    free(fiber_node);
+    return ret;
+}
+
+/**
+ * @brief Switch to any fiber that is not running
+ *
+ * The fiber is chosen by the kernel from the ready queue of the fibers of the process, according
+ * to the policy set with @ref SetReadyQueuePolicy, so the switch does not fail because the fiber is
+ * already running. The kernel writes the id of the fiber in the running fiber of the thread.
+ *
+ * @return int 0 if the thread switched, -1 otherwise, errno is ERR_NO_IDLE_FIBER if all the
+ * fibers are running
+ */
+int SwitchToAnyFiber() {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "SwitchToAnyFiber()\n");
+#endif
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    return ioctl(dev_fd, FIBER_IOC_SWITCHTOANY, (unsigned long)&running_fid);
+}
+
+/**
+ * @brief Set the policy used by @ref SwitchToAnyFiber for choosing the fiber
+ *
+ * @param policy FIBER_RQ_FIFO for the fiber idle for the longest time, FIBER_RQ_LIFO for the
+ * fiber that became idle last
+ * @return int
+ */
+int SetReadyQueuePolicy(int policy) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "SetReadyQueuePolicy(%d)\n", policy);
+#endif
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    int ret = ioctl(dev_fd, FIBER_IOC_RQ_POLICY, (unsigned long)policy);
+    if (ret < 0) {
+        printf(LIBRARY_TAG CORE_TAG "SetReadyQueuePolicy() ioctl error, errno %d\n", errno);
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Set how often the statistics of the fibers of the process are collected
+ *
+ * @param period 0 for disabling them, 1 for collecting them at every switch, N for sampling one
+ * switch every N. The default is set by the `stats_period` parameter of the module
+ * @return int
+ */
+int SetFiberStatistics(unsigned long period) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "SetFiberStatistics(%lu)\n", period);
+#endif
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    int ret = ioctl(dev_fd, FIBER_IOC_STATS, period);
+    if (ret < 0) {
+        printf(LIBRARY_TAG CORE_TAG "SetFiberStatistics() ioctl error, errno %d\n", errno);
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Enable or disable the hardware counters of the fibers of the process
+ *
+ * The cycles, instructions and cache misses counted while a fiber runs are shown in its file in
+ * `/proc/<pid>/fibers`
+ *
+ * @param enable 0 for disabling them, any other value for enabling them
+ * @return int
+ */
+int SetFiberPerfCounters(int enable) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "SetFiberPerfCounters(%d)\n", enable);
+#endif
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return -1;
+    int ret = ioctl(dev_fd, FIBER_IOC_PERF, (unsigned long)(enable != 0));
+    if (ret < 0) {
+        printf(LIBRARY_TAG CORE_TAG "SetFiberPerfCounters() ioctl error, errno %d\n", errno);
         return -1;
     }
     return ret;
 }
 
+/**
+ * @brief Get the statistics of all the fibers of a process
+ *
+ * # Implementation
+ * The records are copied by the kernel in a single call, see @ref FIBER_IOC_SNAPSHOT, the array is
+ * grown and the call repeated from where it stopped only if the process has more fibers than the
+ * array can hold, so the cost does not depend on the number of fibers.
+ *
+ * @param pid the process, 0 for the calling one
+ * @param count set to the number of records of the snapshot
+ * @return fiber_snapshot_t* the records, ordered by fiber id, that must be freed by the caller, or
+ * NULL on error
+ */
+fiber_snapshot_t *GetFibersSnapshot(int pid, int *count) {
+#ifdef DEBUG
+    printf(LIBRARY_TAG CORE_TAG "GetFibersSnapshot(%d)\n", pid);
+#endif
+    int dev_fd = open_device();
+    if (dev_fd < 0 || fcntl(dev_fd, F_GETFD) < 0) return NULL;
+    unsigned long size = FIBER_SNAPSHOT_CHUNK, copied = 0;
+    fiber_snapshot_t *records = NULL, *grown;
+    fiber_snapshot_params_t params = {.pid = pid, .next = 0};
+    while (params.next != FIBER_SNAPSHOT_END) {
+        grown = (fiber_snapshot_t *)realloc(records, size * sizeof(fiber_snapshot_t));
+        if (grown == NULL) goto err;
+        records = grown;
+        params.records = (unsigned long)(records + copied);
+        params.count = size - copied;
+        int ret = ioctl(dev_fd, FIBER_IOC_SNAPSHOT, (unsigned long)&params);
+        if (ret < 0) {
+            printf(LIBRARY_TAG CORE_TAG "GetFibersSnapshot() ioctl error, errno %d\n", errno);
+            goto err;
+        }
+        copied += ret;
+        size *= 2;
+    }
+    *count = copied;
+    return records;
+
+err:
+    free(records);
+    return NULL;
+}
+
 /**
  * @brief Tells the kernel module that the process is going to terminate
  *
@@ -174,6 +451,9 @@ int ExitFibered() {
         printf(LIBRARY_TAG CORE_TAG "ExitFibered() ioctl error, errno %d\n", errno);
         return -1;
     }
+    // the local storage of the fibers is gone
+    unmap_fls();
+    running_fid = -1;
     return ret;
 }
 
@@ -226,6 +506,14 @@ long FlsGetValue(long index) {
 #ifdef DEBUG
     printf(LIBRARY_TAG CORE_TAG "FlsGetValue(%ld)\n", index);
 #endif
+    long *storage = running_fls();
+    if (storage != NULL) {
+        if (!fls_is_allocated(index)) {
+            errno = ERR_FLS_INVALID_INDEX;
+            return -1;
+        }
+        return storage[index];
+    }
     fls_params_t *req_params = (fls_params_t *)malloc(sizeof(fls_params_t));
     req_params->idx = index;
     req_params->value = 0;
@@ -257,6 +545,15 @@ int FlsSetValue(long index, long value) {
 #ifdef DEBUG
     printf(LIBRARY_TAG CORE_TAG "FlsSetValue(%ld,%ld)\n", index, (unsigned long)value);
 #endif
+    long *storage = running_fls();
+    if (storage != NULL) {
+        if (!fls_is_allocated(index)) {
+            errno = ERR_FLS_INVALID_INDEX;
+            return -1;
+        }
+        storage[index] = value;
+        return 0;
+    }
     // prepare the params
     fls_params_t *params = (fls_params_t *)malloc(sizeof(fls_params_t));
     params->idx = index;
@@ -293,6 +590,37 @@ void safe_cleanup() {
     exit(0);
 }
 
+/**
+ * @brief Prepare the params of a new fiber, allocating its stack
+ *
+ * @param stack_size
+ * @param function
+ * @param args
+ * @param flags
+ * @return fiber_params_t* the params, kept by the fiber for releasing the stack
+ */
+fiber_params_t *prepare_fiber_params(unsigned long stack_size, void *(*function)(void *),
+                                     void *args, unsigned long flags) {
+    fiber_params_t *params = (fiber_params_t *)malloc(sizeof(fiber_params_t));
+    params->function = (unsigned long)function;
+    params->function_args = (unsigned long)args;
+    params->flags = flags;
+    // params->stack_addr = (unsigned long)malloc(stack_size) + stack_size;
+    params->stack_addr = (unsigned long)aligned_alloc(16, stack_size) + stack_size;
+#ifdef DEBUG
+    printf("Is stack aligned: %d\n", params->stack_addr % 16 == 0);
+    printf("Stack addr is %lu\n", params->stack_addr);
+#endif
+    params->stack_size = stack_size;
+    // -> set the return address to the desired cleanup function,
+    //    return address is the first cell of the stack, this an implementation what the call
+    //    instruction should have done. The following two lines are equivalent to the push of the
+    //    ret address
+    ((unsigned long *)params->stack_addr)[0] = (unsigned long)&safe_cleanup;
+    params->stack_addr -= 8;
+    return params;
+}
+
 /**
  * @brief Clean all the memory structures created by the library
  *
@@ -303,30 +631,104 @@ void clean_memory() {
 #endif
     fiber_t *curr_fiber = NULL;
     fiber_t *temp_fiber = NULL;
+    pthread_mutex_lock(&fibers_list.lock);
     if (!list_empty(&fibers_list.list)) {
         list_for_each_entry_safe(curr_fiber, temp_fiber, &fibers_list.list, list) {
             // check if fiber is created with conver_thread_to_fiber
-            if (curr_fiber->params != NULL) {
-                // free stack
-                if (curr_fiber->params->stack_addr != 0) {
-                    // emulates the pop %rbp
-                    curr_fiber->params->stack_addr += 8;
-                    free((void *)(curr_fiber->params->stack_addr - curr_fiber->params->stack_size));
-                }
-                // free params
-                free(curr_fiber->params);
-            }
+            if (curr_fiber->params != NULL) free_fiber_params(curr_fiber->params);
             // remove fiber from list
             list_del(&curr_fiber->list);
             // free fiber
             free(curr_fiber);
         }
     }
+    // free the index
+    for (int i = 0; i < FIBERS_TABLE_CHUNKS; i++) {
+        free(fibers_list.table[i]);
+        fibers_list.table[i] = NULL;
+    }
+    pthread_mutex_unlock(&fibers_list.lock);
+}
+
+/**
+ * @brief Free the params of a fiber together with its stack
+ *
+ * @param params
+ */
+void free_fiber_params(fiber_params_t *params) {
+    // free stack
+    if (params->stack_addr != 0) {
+        // emulates the pop %rbp
+        params->stack_addr += 8;
+        free((void *)(params->stack_addr - params->stack_size));
+    }
+    // free params
+    free(params);
+}
+
+/**
+ * @brief Index the given fiber by its slot in the fibers table, see @ref FIBER_FID_SLOT, must be
+ * called holding fibers_list::lock
+ *
+ * @param fiber_node
+ * @return int 0 if the fiber has been indexed, otherwise -1 if its slot is out of the table range,
+ * in that case it can only be found in the list
+ */
+int index_fiber(fiber_t *fiber_node) {
+    unsigned slot = FIBER_FID_SLOT(fiber_node->id);
+    unsigned chunk = slot / FIBERS_TABLE_CHUNK;
+    if (chunk >= FIBERS_TABLE_CHUNKS) return -1;
+    if (fibers_list.table[chunk] == NULL) {
+        fibers_list.table[chunk] = (fiber_t **)calloc(FIBERS_TABLE_CHUNK, sizeof(fiber_t *));
+        if (fibers_list.table[chunk] == NULL) return -1;
+    }
+    fibers_list.table[chunk][slot % FIBERS_TABLE_CHUNK] = fiber_node;
+    return 0;
+}
+
+/**
+ * @brief Remove the given fiber from the fibers table, if it is indexed, must be called holding
+ * fibers_list::lock
+ *
+ * @param fiber_node
+ */
+void unindex_fiber(fiber_t *fiber_node) {
+    unsigned slot = FIBER_FID_SLOT(fiber_node->id);
+    unsigned chunk = slot / FIBERS_TABLE_CHUNK;
+    if (chunk >= FIBERS_TABLE_CHUNKS || fibers_list.table[chunk] == NULL) return;
+    if (fibers_list.table[chunk][slot % FIBERS_TABLE_CHUNK] == fiber_node)
+        fibers_list.table[chunk][slot % FIBERS_TABLE_CHUNK] = NULL;
+}
+
+/**
+ * @brief Find a local fiber given its id, must be called holding fibers_list::lock
+ *
+ * The slot of a deleted fiber can be taken by a new one, so the fiber in the slot is returned
+ * only if it has the same id, that is the same generation.
+ *
+ * @param fid
+ * @return fiber_t* the fiber or NULL if it does not exist
+ */
+fiber_t *lookup_fiber(unsigned fid) {
+    fiber_t *fiber_node;
+    unsigned slot = FIBER_FID_SLOT(fid);
+    unsigned chunk = slot / FIBERS_TABLE_CHUNK;
+    if (chunk < FIBERS_TABLE_CHUNKS) {
+        if (fibers_list.table[chunk] == NULL) return NULL;
+        fiber_node = fibers_list.table[chunk][slot % FIBERS_TABLE_CHUNK];
+        return fiber_node != NULL && fiber_node->id == fid ? fiber_node : NULL;
+    }
+    // out of the table range, fallback to the list
+    check_if_exists(fiber_node, &fibers_list.list, id, fid, list, fiber_t);
+    return fiber_node;
 }
 
 /**
  * @brief Open the fiber device
  *
+ * The process is released by the module with its last reference to the file, so the file is
+ * closed on exec, otherwise the children started with posix_spawn or system would keep it.
+ *
  * @return int
  */
 int open_device() {
@@ -334,7 +736,7 @@ int open_device() {
     printf(LIBRARY_TAG CORE_TAG "open_device()\n");
 #endif
     if (fiber_dev_fd < 0) {
-        fiber_dev_fd = open(FIBER_DEV_PATH, O_RDWR, 0666);
+        fiber_dev_fd = open(FIBER_DEV_PATH, O_RDWR | O_CLOEXEC);
         if (fiber_dev_fd < 0) {
             printf(LIBRARY_TAG CORE_TAG "Cannot open " FIBER_DEV_PATH ", errno %d.\n", errno);
             return -1;
@@ -343,6 +745,105 @@ int open_device() {
     return fiber_dev_fd;
 }
 
+/**
+ * @brief Map the fiber local storage of a fiber of the process
+ *
+ * The bitmap of the indexes is mapped first, then the chunk of @ref FLS_MAPPING_CHUNK fibers of
+ * @p fid, if it is not mapped yet, so the address space that is reserved grows with the indexes
+ * of the fibers in use, instead of covering all the fibers of the domain. The kernel only provides
+ * the pages that are accessed, allocating the chunks of values that the fiber did not use yet. The
+ * chunks are never moved, so the other threads can use them without locks. If a mapping fails,
+ * for example because of the limits of the address space, the local storage of the fibers that
+ * are not mapped is accessed through the ioctls.
+ *
+ * @param dev_fd
+ * @param fid the fiber whose local storage must be mapped
+ */
+void map_fls(int dev_fd, unsigned fid) {
+    unsigned chunk = FIBER_FID_INDEX(fid) / FLS_MAPPING_CHUNK;
+    void *mapping;
+    if (fls_chunks[chunk] != NULL) return;
+    sem_wait(&device_sem);
+    if (fls_bitmap == NULL) {
+        mapping = mmap(NULL, FLS_MAP_BITMAP_SIZE, PROT_READ, MAP_SHARED, dev_fd, 0);
+        if (mapping == MAP_FAILED) goto err;
+        fls_bitmap = (unsigned long *)mapping;
+    }
+    if (fls_chunks[chunk] == NULL) {
+        mapping = mmap(NULL, FLS_MAPPING_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_NORESERVE, dev_fd,
+                       FLS_MAP_BITMAP_SIZE + chunk * FLS_MAPPING_CHUNK_SIZE);
+        if (mapping == MAP_FAILED) goto err;
+        fls_chunks[chunk] = (char *)mapping;
+    }
+    sem_post(&device_sem);
+    return;
+
+err:
+    sem_post(&device_sem);
+    printf(LIBRARY_TAG CORE_TAG "Cannot map " FIBER_DEV_PATH ", errno %d.\n", errno);
+}
+
+/**
+ * @brief Unmap the fiber local storage of all the fibers of the process
+ *
+ */
+void unmap_fls() {
+    sem_wait(&device_sem);
+    for (int i = 0; i < FLS_MAPPING_CHUNKS; i++) {
+        if (fls_chunks[i] != NULL) munmap(fls_chunks[i], FLS_MAPPING_CHUNK_SIZE);
+        fls_chunks[i] = NULL;
+    }
+    if (fls_bitmap != NULL) munmap(fls_bitmap, FLS_MAP_BITMAP_SIZE);
+    fls_bitmap = NULL;
+    sem_post(&device_sem);
+}
+
+/**
+ * @brief Get the values of the local storage of the fiber that the thread is running in the
+ * mapping
+ *
+ * @return long* NULL if the thread is not a fiber or the device is not mapped
+ */
+long *running_fls() {
+    if (running_fid < 0) return NULL;
+    unsigned index = FIBER_FID_INDEX(running_fid);
+    char *chunk = fls_chunks[index / FLS_MAPPING_CHUNK];
+    if (chunk == NULL) return NULL;
+    return (long *)(chunk + (size_t)(index % FLS_MAPPING_CHUNK) * FLS_MAP_SIZE);
+}
+
+/**
+ * @brief Check if the index of the local storage has been allocated with FlsAlloc, by reading the
+ * bitmap of the indexes at the beginning of the mapping
+ *
+ * @param index
+ * @return int
+ */
+int fls_is_allocated(long index) {
+    const unsigned bits = 8 * sizeof(unsigned long);
+    unsigned long *bitmap = fls_bitmap;
+    if (index < 0 || index >= MAX_FLS) return 0;
+    return (bitmap[index / bits] >> (index % bits)) & 1;
+}
+
+/**
+ * @brief Drop the inherited fiber device in a forked child
+ *
+ * The module binds a process to the file of the device that it opened, so the child must open its
+ * own one before using fibers. The child does not run the fibers of the parent.
+ */
+void reset_device() {
+    if (fiber_dev_fd >= 0) close(fiber_dev_fd);
+    fiber_dev_fd = -1;
+    // the mappings are not inherited
+    fls_bitmap = NULL;
+    memset(fls_chunks, 0, sizeof(fls_chunks));
+    running_fid = -1;
+    // the lock could have been held by a thread of the parent, that does not exist in the child
+    pthread_mutex_init(&fibers_list.lock, NULL);
+}
+
 /**
  * @brief
  *
@@ -353,6 +854,7 @@ __attribute__((constructor)) void start(void) {
     printf(LIBRARY_TAG CORE_TAG "start() constructor called\n");
 #endif
     sem_init(&device_sem, 0, 1);
+    pthread_atfork(NULL, NULL, reset_device);
 }
 
 /**
@@ -41,33 +41,68 @@
 #include <asm/fpu/types.h>
 #include <asm/ptrace.h>
 #include <linux/bitmap.h>
+#include <linux/cache.h>
 #include <linux/fdtable.h>
 #include <linux/fs.h>
 #include <linux/hashtable.h>
+#include <linux/idr.h>
+#include <linux/jump_label.h>
 #include <linux/ioctl.h>
 #include <linux/kernel.h>
-#include <linux/kprobes.h>
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
 #include <linux/sched/task_stack.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
 #include <linux/semaphore.h>
+#include <linux/shrinker.h>
 #include <linux/signal.h>
 #include <linux/slab.h>
+#include <linux/sched/clock.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/timex.h>
+#include <linux/timekeeping.h>
 #include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #define CORE_LOG ": CORE: "
+// the maximum number of freed fiber nodes that every cpu keeps for reusing them
+#define FIBER_CACHE_CPU_MAX 64
+// the hardware counters of the fibers, see fiber_perf_t
+#define FIBER_PERF_CYCLES 0
+#define FIBER_PERF_INSTRUCTIONS 1
+#define FIBER_PERF_CACHE_MISSES 2
+#define FIBER_PERF_EVENTS 3
+// the buckets of the histogram of the latency of the switches, bucket i counts the switches that
+// took less than 2^i cycles and at least 2^(i-1), the last one also the longer ones
+#define FIBER_LATENCY_BUCKETS 32
+// the generations of the indexes of the fibers of a domain are kept in pages of one byte each
+#define FIBER_GEN_CHUNK PAGE_SIZE
+
 
 /*
  * Definitions
  */
 
 typedef struct fibered_process fibered_process_node_t;
+typedef struct fibered_thread fibered_thread_node_t;
+typedef struct fiber_domain fiber_domain_t;
 typedef struct fiber_processes_list fiber_process_list_t;
 typedef struct fiber fiber_node_t;
 typedef struct fibers_list fibers_list_t;
 typedef struct fiber_params fiber_params_t;
+typedef struct fibered_processes_stats fibered_processes_stats_t;
+typedef struct fiber_cache_cpu fiber_cache_cpu_t;
+typedef struct fiber_perf fiber_perf_t;
+typedef struct fibered_process_counters fibered_process_counters_t;
+typedef struct fibered_process_summary fibered_process_summary_t;
+typedef struct fiber_counters fiber_counters_t;
 
 /*
  * Exposed methods
@@ -76,25 +111,47 @@ typedef struct fiber_params fiber_params_t;
 int init_core(void);
 void destroy_core(void);
 // implementations core fns
-int convert_thread_to_fiber(void);
-int create_fiber(fiber_params_t *params);
-int switch_to_fiber(unsigned fid);
+int convert_thread_to_fiber(struct file *filp);
+int create_fiber(struct file *filp, fiber_params_t *params);
+int switch_to_fiber(struct file *filp, unsigned fid);
+int switch_to_any_fiber(struct file *filp, long *fid);
+int set_ready_queue_policy(struct file *filp, unsigned long policy);
+int set_stats_period(struct file *filp, unsigned long period);
+int set_perf_counters(struct file *filp, unsigned long enable);
+int delete_fiber(struct file *filp, unsigned fid);
 // implementation of fls
-int fls_alloc(void);
-int fls_free(long);
-long fls_get(fls_params_t *);
-int fls_set(fls_params_t *);
-// not explicitly callable by user
-int exit_fibered(void);
-// kprobe handlers
-int pre_exit_handler(struct kprobe *p, struct pt_regs *regs);
-void post_exit_handler(struct kprobe *p, struct pt_regs *regs, unsigned long flags);
+int fls_alloc(struct file *filp);
+int fls_free(struct file *filp, long);
+long fls_get(struct file *filp, fls_params_t *);
+int fls_set(struct file *filp, fls_params_t *);
+struct page *fls_get_page(struct file *filp, unsigned long pgoff);
+// batches of operations
+int run_batch(struct file *filp, fiber_batch_params_t *params);
+// statistics
+int snapshot_fibers(fiber_snapshot_params_t *params);
+// teardown of the process
+int exit_fibered(struct file *filp);
+void release_fibered(struct file *filp);
 
 // utils
 fibered_process_node_t *check_if_process_is_fibered(unsigned process_pid);
-fiber_node_t *check_if_this_thread_is_fiber(fibered_process_node_t *fibered_process_node);
-fiber_node_t *check_if_fiber_exist(fibered_process_node_t *fibered_process_node, unsigned fid);
-unsigned long get_actual_fiber_time(fiber_node_t *current_fiber_node);
+fibered_thread_node_t *check_if_thread_is_fibered(fiber_domain_t *domain, pid_t thread_pid);
+fiber_node_t *check_if_this_thread_is_fiber(fiber_domain_t *domain);
+fiber_node_t *check_if_fiber_exist(fiber_domain_t *domain, unsigned fid);
+fiber_node_t *check_if_fiber_exist_in_process(fibered_process_node_t *fibered_process_node,
+                                              unsigned fid);
+fiber_node_t *get_next_fiber_in_process(fibered_process_node_t *fibered_process_node,
+                                        unsigned slot);
+u64 get_actual_fiber_time(fiber_node_t *current_fiber_node);
+u64 get_current_cpu_time(void);
+struct page *get_fls_chunk(fiber_node_t *fiber_node, unsigned chunk_index,
+                           struct page **spare_chunk);
+void get_fibered_processes_stats(fibered_processes_stats_t *stats);
+void get_fibered_process_summary(fibered_process_node_t *fibered_process_node,
+                                 fibered_process_summary_t *summary);
+void get_fiber_counters(fiber_counters_t *counters);
+void get_switch_latency(fibered_process_node_t *fibered_process_node, unsigned long *buckets);
+void reset_switch_latency(fibered_process_node_t *fibered_process_node);
 
 /**
  * @brief The state of the fiber
@@ -108,93 +165,263 @@ typedef enum fiber_state {
 /**
  * @brief Implementation of fiber local storage for fibers
  *
- * Each fiber has its own storage made of an array of longs, for knowing if a position of the array
- * is allocated or not, a bitmap is used.
+ * The indexes of the local storage are allocated for the whole domain in fiber_domain::fls_bitmap,
+ * each fiber only keeps its values. The values are kept in pages of @ref FLS_CHUNK_CELLS cells,
+ * that are allocated zeroed the first time that a cell of the chunk is set or mapped, so fibers
+ * that do not use the local storage do not pay for it.
  */
 typedef struct fiber_local_storage {
-    DECLARE_BITMAP(fls_bitmap, MAX_FLS); /**< The bitmap for the local storage, used for knowning
-                                            which cells of the array are set*/
-    long fls[MAX_FLS];                   /**< The actual array of the local storage */
+    struct page *chunks[FLS_CHUNKS]; /**< The chunks of values, NULL if not allocated yet */
 } fiber_local_storage_t;
 
 /**
  * @brief A node in the @ref fibers_list. This type fully represent a @c fiber
  *
- * This is the complete description of a fiber.
+ * This is the complete description of a fiber. The fields are grouped by how they are used, so
+ * that a switch touches as few cache lines as possible:
+ * - the hot header, that starts the node, holds only what every @ref switch_to_fiber reads or
+ * writes on both the fibers: the fields up to fiber::ready fit in the first cache line, followed
+ * by fiber::regs;
+ * - the cold part starts on its own cache line with the statistics, that are only updated while
+ * the domain collects them, see @ref account_switch, so with the statistics disabled a switch never
+ * touches it, and fiber::failed_activations_count, that is written by the threads that fail to
+ * claim the fiber, does not bounce the line of fiber::state. Then it holds what is only used at
+ * creation, by the /proc files and by the local storage;
+ * - fiber::fpu_regs, that is only touched for the fibers that use the FPU, and the chunks of the
+ * local storage, that are allocated apart.
  */
 typedef struct fiber {
+    /* hot header */
+    fiber_state_t state ____cacheline_aligned; /**< The current state of the fiber */
     unsigned id;                        /**< Unique if of the fiber, used for ... */
-    unsigned long entry_point;          /**< The starting fuction of the fiber */
-    unsigned long base_user_stack_addr; /** The starting address of the stack that will be
-                                              allocated by the library */
-    fiber_state_t state;                /**< The current state of the fiber */
+    unsigned long flags;                /**< The FIBER_FLAG_* the fiber has been created with */
+    pid_t run_by;                       /**< This field represents:
+    - the `pid` of the thread that is currently running the fiber if @fiber::state is @ref
+    fiber_state::RUNNING
+    - the `pid` of the last thread that executed it if @ref fiber_state::IDLE
+    - -1 if we just called @ref create_fiber*/
+    struct list_head ready; /**< In fiber_domain::ready_queue while the fiber is idle */
     struct pt_regs regs; /**< The current snapshot of cpu registers. The values that we user are:
 - `regs->ip` - The current instruction pointer;
 - `regs->sp` - The current stack pointer.
 */
+
+    /* cold part */
+    // -> statistics
+    unsigned success_activations_count ____cacheline_aligned; /**< Number of successful activation
+                                                                 of the fiber */
+    atomic_t failed_activations_count; /**< Number of failed activation of the fiber */
+    u64 total_time;       /**< Total running time of the fiber in ns, until the last switch */
+    u64 time_last_switch; /**< Time of when the last switch occurred, ns of the monotonic clock */
+    u64 cpu_time;         /**< Time in ns that the fiber spent on a cpu, until the last switch */
+    u64 cpu_time_last_switch; /**< The cpu time of the thread that ran the fiber at the last
+                                 switch, see @ref get_current_cpu_time */
+    // -> creation, /proc and local storage
+    unsigned long entry_point;          /**< The starting fuction of the fiber */
+    unsigned long base_user_stack_addr; /** The starting address of the stack that will be
+                                              allocated by the library */
     pid_t
         created_by; /**< The `pid` of the process (`tgid` of every thread) that created the fiber */
-    pid_t run_by;   /**< This field represents:
-    - the `pid` of the thread that is currently running the fiber if @fiber::state is @ref
-    fiber_state::RUNNING
-    - the `pid` of the last thread that executed it if @ref fiber_state::IDLE
-    - -1 if we just called @ref create_fiber*/
-    unsigned success_activations_count;  /**< Number of successful activation of the fiber */
-    unsigned failed_activations_count;   /**< Number of failed activation of the fiber */
-    unsigned long total_time;            /**< Total running time of the fiber */
-    struct timespec time_last_switch;    /**< Time of when the last switch occurred*/
     struct list_head list;               /**< List implementation structure */
     fiber_local_storage_t local_storage; /**< Fiber local storage */
+    u64 perf_counts[FIBER_PERF_EVENTS]; /**< The hardware events counted while the fiber was
+                                           running, by FIBER_PERF_*, see @ref account_perf */
+    struct rcu_head rcu; /**< Used for freeing a deleted fiber after the readers are done */
 
-    struct fpu fpu_regs; /**< Used for saving the fpu registers*/
+    struct fpu fpu_regs; /**< Used for saving the fpu registers, in the xsave format of the cpu.
+                            Must be the last field, as its state is sized by the cpu features */
 } fiber_node_t;
 
 /**
  * @brief A generic list of fibers
  *
- * The list has the purpose of containing the list of fibers for a given process.
+ * The list has the purpose of containing the list of fibers for a given process. Beside the linked
+ * list, used for walking all the fibers, the fibers are also indexed by their fiber::id in an
+ * @c idr, so that a fiber can be retrieved in constant time given its id. The indexes of the
+ * deleted fibers are reused, every index has its own generation, see @ref FIBER_FID_GEN, that is
+ * kept in the pages of generations, allocated only for the chunks of @ref FIBER_GEN_CHUNK indexes
+ * where a fiber has been deleted.
  *
  */
 typedef struct fibers_list {
     struct list_head list;
-    unsigned fibers_count; /**< Number of fibers created */
+    struct idr fibers_idr;  /**< The fibers indexed by fiber::id */
+    struct idr generations; /**< The pages of the generations of the indexes, by index /
+                               FIBER_GEN_CHUNK, see @ref get_fiber_generation */
+    unsigned fibers_count;  /**< Number of fibers created */
 } fibers_list_t;
 
+/**
+ * @brief A thread of a @ref fibered_process that has been converted to a fiber in a
+ * @ref fiber_domain
+ *
+ * The node keeps a pointer to the fiber that the thread is currently running, so that the fiber of
+ * the calling thread is found with a lookup in fiber_domain::threads instead of walking the
+ * list of the fibers of the domain.
+ *
+ */
+typedef struct fibered_thread {
+    pid_t pid;                   /**< The pid of the thread */
+    fiber_node_t *running_fiber; /**< The fiber that the thread is currently running */
+    unsigned long switches; /**< The switches of the thread, also for sampling the statistics */
+    fiber_perf_t *perf; /**< The hardware counters of the thread, NULL if not created yet, an error
+                           pointer if they are not available */
+    struct hlist_node hlist;     /**< Hashlist implementation structure */
+} fibered_thread_node_t;
+
+/**
+ * @brief The fibers of a file of the device
+ *
+ * Every open of the device gives an independent domain, that is created by the first
+ * @ref convert_thread_to_fiber made through the file and kept in its `private_data`, so the
+ * operations on the fibers do not need any global lookup. A thread can only switch to the fibers
+ * of the domain it has been converted in. A process can shard its fibers across several domains
+ * for reducing the contention on fiber_domain::lock.
+ *
+ * The fibers that are not running are also kept in fiber_domain::ready_queue, so that a thread can
+ * switch to any idle fiber without guessing its id, see @ref switch_to_any_fiber.
+ *
+ */
+typedef struct fiber_domain {
+    unsigned id; /**< The id of the domain in its process, see @ref FIBER_FID_DOMAIN */
+    pid_t pid;   /**< the pid of the process that owns the domain, so the tgid of its threads */
+    fibered_process_node_t *process; /**< The process that owns the domain */
+    spinlock_t lock; /**< Serializes the writers of fibers_list and threads, readers use RCU */
+    fibers_list_t fibers_list; /**< A list of fibers created in the domain (so by any thread of
+                                  the process through the file) */
+    DECLARE_HASHTABLE(threads, THREADS_HASH_KEY_SIZE); /**< The threads of the process that have
+                                                          been converted to fibers in the domain,
+                                                          by pid */
+    unsigned long *fls_bitmap; /**< The indexes of the local storage allocated in the domain, a
+                                  page so that it can be mapped in user space */
+    spinlock_t rq_lock; /**< Protects ready_queue and the moves of fibers to fiber_state::IDLE */
+    struct list_head ready_queue; /**< The idle fibers of the domain, by fiber::ready */
+    unsigned threads_count; /**< The number of threads in threads, so of running fibers */
+    unsigned rq_policy;           /**< The policy of ready_queue, FIBER_RQ_FIFO or FIBER_RQ_LIFO */
+    unsigned stats_period; /**< The statistics of the fibers are collected at one switch every
+                              stats_period, never if 0, see @ref account_switch */
+    bool perf_enabled;        /**< The hardware counters of the fibers are collected */
+    unsigned perf_generation; /**< Incremented every time the counters are enabled */
+    struct list_head list; /**< List implementation structure, in fibered_process::domains */
+    struct rcu_head rcu;   /**< Used for freeing the domain after the readers are done */
+} fiber_domain_t;
+
 /**
  * @brief A node of the list of processes in @ref fibered_processes_list, a **fiber-enabled**
  * process
  *
  * A @ref fibered_process is a process in which at least one thread has been converted to a fiber,
- * so a fibered_process always has at least one fiber in the fibered_process::fibers_list field.
- * Moreover the first element of the list has fibered_process::prev pointing to @c NULL and the last
- * element of the list has fibered_process::next pointing to @c NULL.
+ * so a fibered_process always has at least one @ref fiber_domain in the fibered_process::domains
+ * field. The process is used for finding the fibers of a pid in the /proc files, the fiber
+ * operations go directly to the domain of the file.
  *
  */
 typedef struct fibered_process {
     pid_t pid; /**< the pid of the main thread, so the tgid of every thread of the process */
-    fibers_list_t fibers_list; /**< A list of fibers created in the process environment (so by any
-                                  thread in it) */
-#ifdef USE_HASH_LIST
-    struct hlist_node hlist; /**< Hashlist implementation structure */
-#else
-    struct list_head list; /**< List implementation structure */
-#endif
+    u64 start_time; /**< The start time of the main thread, that tells the process from a later
+                       one with the same pid, see @ref bind_fiber_domain */
+    struct list_head domains; /**< The domains of the process, modified under the mutex of the
+                                 module, readers use RCU */
+    DECLARE_BITMAP(domains_ids, FIBER_MAX_DOMAINS); /**< The ids used by the domains */
+    struct proc_dir_entry *proc_dir; /**< The /proc/fibers/<pid> directory, NULL if it could not
+                                        be created, see @ref proc_register_process */
+    fibered_process_counters_t __percpu *counters; /**< The counters of the switches of the
+                                                      threads, summed only when they are read */
+    struct rhash_head hnode; /**< Hash table implementation structure */
+    struct rcu_head rcu; /**< Used for freeing the process after the readers are done */
 } fibered_process_node_t;
 
 /**
  * @brief The list of processes that have at least one fiber
  *
  * This list has the purpose of containing the list of processes that have created at least one
- * fiber and they became fiber-enabled.
+ * fiber and they became fiber-enabled. It is implemented as a @c rhashtable keyed by
+ * fibered_process::pid, that is resized automatically and can be read under RCU.
  *
  */
 typedef struct fibered_processes_list {
-#ifdef USE_HASH_LIST
-    DECLARE_HASHTABLE(hash_table, HASH_KEY_SIZE);
-#else
-    struct list_head list;
-#endif
-    unsigned processes_count; /**< The number of elements in the list */
+    struct rhashtable hash_table; /**< The processes by pid, the number of elements is nelems */
 } fibered_processes_list_t;
 
+/**
+ * @brief Statistics about the occupancy of fibered_processes_list::hash_table
+ *
+ */
+typedef struct fibered_processes_stats {
+    unsigned processes;        /**< Number of fibered processes in the table */
+    unsigned buckets;          /**< Number of buckets of the table */
+    unsigned used_buckets;     /**< Number of buckets with at least one process */
+    unsigned max_chain_length; /**< Length of the longest chain of a bucket */
+} fibered_processes_stats_t;
+
+/**
+ * @brief The fiber nodes freed on a cpu, that are reused before allocating new ones
+ *
+ * The nodes are linked by fiber::list, that is free once the fiber has been removed from its
+ * domain.
+ */
+typedef struct fiber_cache_cpu {
+    spinlock_t lock;       /**< Protects the list, against the RCU callbacks and the shrinker */
+    struct list_head free; /**< The free nodes */
+    unsigned count;        /**< The number of nodes in the list */
+} fiber_cache_cpu_t;
+
+/**
+ * @brief The hardware counters of a thread, that are attributed to the fibers it runs
+ *
+ * The counters are kernel perf events bound to the thread, they are read at every switch and the
+ * difference from the previous reading goes to the fiber that the thread is leaving, see
+ * @ref account_perf. Releasing the events can sleep, so it is deferred to fiber_perf::work when
+ * the domain is freed.
+ */
+typedef struct fiber_perf {
+    struct perf_event *events[FIBER_PERF_EVENTS]; /**< The events, by FIBER_PERF_* */
+    u64 last[FIBER_PERF_EVENTS]; /**< The values of the events at the last switch */
+    unsigned generation;   /**< The fiber_domain::perf_generation of the last switch */
+    struct work_struct work; /**< Releases the events */
+} fiber_perf_t;
+
+/**
+ * @brief The counters of a @ref fibered_process on a cpu
+ *
+ * They are updated by every switch of the threads of the process, so they are kept per cpu in
+ * fibered_process::counters, the switches of different threads do not share any cache line.
+ */
+typedef struct fibered_process_counters {
+    unsigned long switches;           /**< The successful switches */
+    unsigned long failed_activations; /**< The switches to a fiber that was already running */
+    unsigned long latency[FIBER_LATENCY_BUCKETS]; /**< The histogram of the cycles taken by the
+                                                     successful switches while the statistics
+                                                     are enabled */
+} fibered_process_counters_t;
+
+/**
+ * @brief The aggregate figures of the fibers of a process, see @ref get_fibered_process_summary
+ *
+ */
+typedef struct fibered_process_summary {
+    unsigned domains;                 /**< Number of domains of the process */
+    unsigned fibers;                  /**< Number of fibers of all the domains */
+    unsigned running;                 /**< Number of running fibers, one per converted thread */
+    unsigned long switches;           /**< Successful switches of all the threads */
+    unsigned long failed_activations; /**< Failed switches to a running fiber */
+} fibered_process_summary_t;
+
+/**
+ * @brief The counters of the operations of all the processes on a cpu
+ *
+ * Every cpu updates its own ones, so the operations of different processes do not share any cache
+ * line, they are summed only when they are read, see @ref get_fiber_counters.
+ */
+typedef struct fiber_counters {
+    unsigned long conversions;     /**< Threads converted to fibers */
+    unsigned long creations;       /**< Fibers created */
+    unsigned long deletions;       /**< Fibers deleted */
+    unsigned long switches;        /**< Successful switches */
+    unsigned long failed_switches; /**< Switches that failed, for any reason */
+    unsigned long fls_ops;         /**< Successful operations on the local storage through the
+                                      device, the accesses through the mapping are not counted */
+    unsigned long exits;           /**< Domains released */
+} fiber_counters_t;
+
 #endif
\ No newline at end of file
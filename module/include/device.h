@@ -42,6 +42,7 @@
 #include <linux/ioctl.h>
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/sched/task_stack.h>
 #include <linux/semaphore.h>
@@ -73,7 +74,4 @@ typedef struct fiber_dev {
     struct miscdevice device;
 } fiber_dev_t;
 
-extern spinlock_t fiber_spinlock;
-extern unsigned long irq_flags;
-
 #endif
\ No newline at end of file
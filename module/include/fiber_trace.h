@@ -0,0 +1,194 @@
+// Copyright (C) 2018 Gabriele Proietti Mattia <gabry.gabry@hotmail.it> & Alexandru Daniel Tufa
+// <alex.tufa94@gmail.com>
+//
+// This file is part of Fibers (Kernel Module).
+//
+// Fibers (Kernel Module) is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Fibers (Kernel Module) is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Fibers (Kernel Module).  If not, see <http://www.gnu.org/licenses/>.
+//
+
+/**
+ * @brief The tracepoints of the module
+ *
+ * The events are in the `fiber` system, so they can be enabled in
+ * `/sys/kernel/debug/tracing/events/fiber` or used by perf and bpftrace as `fiber:<event>`. When
+ * they are disabled they cost a patched out branch. The operations on the local storage that the
+ * library does through the mapping of the device do not enter the kernel, so they are not traced.
+ *
+ * The tracepoints are created in core.c, that defines `CREATE_TRACE_POINTS`, this header is
+ * read more than once so it is not protected as the other ones.
+ *
+ * @file fiber_trace.h
+ * @author Gabriele Proietti Mattia <gabry.gabry@hotmail.it>
+ * @author Alexandru Daniel Tufa <alex.tufa94@gmail.com>
+ * @date 2018-05-13
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fiber
+
+#if !defined(_FIBER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FIBER_TRACE_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * A new fiber, by converting the current thread or created by it
+ */
+DECLARE_EVENT_CLASS(fiber_new_class,
+    TP_PROTO(unsigned fid, unsigned long entry_point),
+    TP_ARGS(fid, entry_point),
+    TP_STRUCT__entry(
+        __field(pid_t, tgid)
+        __field(pid_t, pid)
+        __field(unsigned, fid)
+        __field(unsigned long, entry_point)
+    ),
+    TP_fast_assign(
+        __entry->tgid = current->tgid;
+        __entry->pid = current->pid;
+        __entry->fid = fid;
+        __entry->entry_point = entry_point;
+    ),
+    TP_printk("tgid=%d pid=%d fid=%u entry_point=%#lx", __entry->tgid, __entry->pid, __entry->fid,
+              __entry->entry_point)
+);
+
+DEFINE_EVENT(fiber_new_class, fiber_convert,
+    TP_PROTO(unsigned fid, unsigned long entry_point),
+    TP_ARGS(fid, entry_point)
+);
+
+DEFINE_EVENT(fiber_new_class, fiber_create,
+    TP_PROTO(unsigned fid, unsigned long entry_point),
+    TP_ARGS(fid, entry_point)
+);
+
+/*
+ * A switch of the current thread, the latency is the time spent by the module from the request
+ * of the switch to the replacement of the context
+ */
+TRACE_EVENT(fiber_switch,
+    TP_PROTO(unsigned from_fid, unsigned to_fid, u64 latency),
+    TP_ARGS(from_fid, to_fid, latency),
+    TP_STRUCT__entry(
+        __field(pid_t, tgid)
+        __field(pid_t, pid)
+        __field(int, cpu)
+        __field(unsigned, from_fid)
+        __field(unsigned, to_fid)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->tgid = current->tgid;
+        __entry->pid = current->pid;
+        __entry->cpu = raw_smp_processor_id();
+        __entry->from_fid = from_fid;
+        __entry->to_fid = to_fid;
+        __entry->latency = latency;
+    ),
+    TP_printk("tgid=%d pid=%d cpu=%d from=%u to=%u latency=%llu", __entry->tgid, __entry->pid,
+              __entry->cpu, __entry->from_fid, __entry->to_fid, __entry->latency)
+);
+
+/*
+ * A switch to a fiber that failed, the error is the one returned to the thread
+ */
+TRACE_EVENT(fiber_switch_failed,
+    TP_PROTO(unsigned to_fid, int error),
+    TP_ARGS(to_fid, error),
+    TP_STRUCT__entry(
+        __field(pid_t, tgid)
+        __field(pid_t, pid)
+        __field(unsigned, to_fid)
+        __field(int, error)
+    ),
+    TP_fast_assign(
+        __entry->tgid = current->tgid;
+        __entry->pid = current->pid;
+        __entry->to_fid = to_fid;
+        __entry->error = error;
+    ),
+    TP_printk("tgid=%d pid=%d to=%u error=%d", __entry->tgid, __entry->pid, __entry->to_fid,
+              __entry->error)
+);
+
+/*
+ * An operation on the fiber local storage, the value is the one read or written, if any
+ */
+DECLARE_EVENT_CLASS(fiber_fls_class,
+    TP_PROTO(long index, long value),
+    TP_ARGS(index, value),
+    TP_STRUCT__entry(
+        __field(pid_t, tgid)
+        __field(pid_t, pid)
+        __field(long, index)
+        __field(long, value)
+    ),
+    TP_fast_assign(
+        __entry->tgid = current->tgid;
+        __entry->pid = current->pid;
+        __entry->index = index;
+        __entry->value = value;
+    ),
+    TP_printk("tgid=%d pid=%d index=%ld value=%#lx", __entry->tgid, __entry->pid, __entry->index,
+              __entry->value)
+);
+
+DEFINE_EVENT(fiber_fls_class, fiber_fls_alloc,
+    TP_PROTO(long index, long value),
+    TP_ARGS(index, value)
+);
+
+DEFINE_EVENT(fiber_fls_class, fiber_fls_free,
+    TP_PROTO(long index, long value),
+    TP_ARGS(index, value)
+);
+
+DEFINE_EVENT(fiber_fls_class, fiber_fls_get,
+    TP_PROTO(long index, long value),
+    TP_ARGS(index, value)
+);
+
+DEFINE_EVENT(fiber_fls_class, fiber_fls_set,
+    TP_PROTO(long index, long value),
+    TP_ARGS(index, value)
+);
+
+/*
+ * A domain of a process that is released, by an exit or by closing the device
+ */
+TRACE_EVENT(fiber_exit,
+    TP_PROTO(pid_t tgid, unsigned domain, unsigned fibers),
+    TP_ARGS(tgid, domain, fibers),
+    TP_STRUCT__entry(
+        __field(pid_t, tgid)
+        __field(unsigned, domain)
+        __field(unsigned, fibers)
+    ),
+    TP_fast_assign(
+        __entry->tgid = tgid;
+        __entry->domain = domain;
+        __entry->fibers = fibers;
+    ),
+    TP_printk("tgid=%d domain=%u fibers=%u", __entry->tgid, __entry->domain, __entry->fibers)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fiber_trace
+#include <trace/define_trace.h>
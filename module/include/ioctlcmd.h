@@ -32,6 +32,13 @@
  * - FlsFree -> FLS_FREE
  * - FlsGetValue -> FLS_GET
  * - FlsSetValue -> FLS_SET
+ * - CreateFibers -> FIBER_IOC_BATCH
+ * - SwitchToAnyFiber -> FIBER_IOC_SWITCHTOANY
+ * - SetReadyQueuePolicy -> FIBER_IOC_RQ_POLICY
+ * - SetFiberStatistics -> FIBER_IOC_STATS
+ * - SetFiberPerfCounters -> FIBER_IOC_PERF
+ * - GetFibersSnapshot -> FIBER_IOC_SNAPSHOT
+ * - DeleteFiber -> FIBER_IOC_DELETE
  *
  * @file ioctlcmd.h
  * @author Gabriele Proietti Mattia <gabry.gabry@hotmail.it>
@@ -55,8 +62,52 @@
 #define FIBER_IOC_FLS_GET _IOR(FIBER_IOC_MAGIC, 6, int)
 #define FIBER_IOC_FLS_SET _IOW(FIBER_IOC_MAGIC, 7, int)
 #define FIBER_IOC_EXIT _IO(FIBER_IOC_MAGIC, 8)
+#define FIBER_IOC_BATCH _IOWR(FIBER_IOC_MAGIC, 9, int)
+#define FIBER_IOC_SWITCHTOANY _IOR(FIBER_IOC_MAGIC, 10, long)
+#define FIBER_IOC_RQ_POLICY _IO(FIBER_IOC_MAGIC, 11)
+#define FIBER_IOC_STATS _IO(FIBER_IOC_MAGIC, 12)
+#define FIBER_IOC_PERF _IO(FIBER_IOC_MAGIC, 13)
+#define FIBER_IOC_SNAPSHOT _IOWR(FIBER_IOC_MAGIC, 14, int)
+#define FIBER_IOC_DELETE _IO(FIBER_IOC_MAGIC, 15)
 // the maximum number of syscall integer id
-#define FIBER_IOC_MAXNR 8
+#define FIBER_IOC_MAXNR 15
+
+/*
+ * Fiber ids
+ * The id of a fiber is made of the index of the fiber in its domain, in the lowest
+ * FIBER_FID_INDEX_BITS bits, and of the id of the domain, that is one per open of the device:
+ * together they are the slot of the fiber in the process. The indexes of the deleted fibers are
+ * reused, so the id also has a generation in the highest bits, that tells a stale id of a deleted
+ * fiber from the one of the new fiber in the same slot.
+ */
+#define FIBER_FID_INDEX_BITS 20
+#define FIBER_FID_DOMAIN_BITS 4
+#define FIBER_FID_GEN_BITS 7
+#define FIBER_FID_SLOT_BITS (FIBER_FID_INDEX_BITS + FIBER_FID_DOMAIN_BITS)
+// the maximum number of fibers of a domain
+#define FIBER_MAX_FIBERS (1 << FIBER_FID_INDEX_BITS)
+// the maximum number of domains of a process
+#define FIBER_MAX_DOMAINS (1 << FIBER_FID_DOMAIN_BITS)
+// the number of slots of a process, the slots are ordered by domain and then by index
+#define FIBER_MAX_SLOTS (1 << FIBER_FID_SLOT_BITS)
+#define FIBER_MAX_GENS (1 << FIBER_FID_GEN_BITS)
+#define FIBER_FID(domain, index) (((domain) << FIBER_FID_INDEX_BITS) | (index))
+#define FIBER_FID_WITH_GEN(fid, gen)                                                               \
+    ((fid) | (((gen) & (FIBER_MAX_GENS - 1)) << FIBER_FID_SLOT_BITS))
+#define FIBER_FID_INDEX(fid) ((fid) & (FIBER_MAX_FIBERS - 1))
+#define FIBER_FID_DOMAIN(fid) (((fid) >> FIBER_FID_INDEX_BITS) & (FIBER_MAX_DOMAINS - 1))
+#define FIBER_FID_SLOT(fid) ((fid) & (FIBER_MAX_SLOTS - 1))
+#define FIBER_FID_GEN(fid) (((fid) >> FIBER_FID_SLOT_BITS) & (FIBER_MAX_GENS - 1))
+
+/*
+ * Ready queue
+ * The idle fibers of a domain are kept in a queue, FIBER_IOC_SWITCHTOANY switches to the first one
+ * according to the policy of the queue.
+ */
+// the fiber that has been idle for the longest time
+#define FIBER_RQ_FIFO 0
+// the fiber that became idle last
+#define FIBER_RQ_LIFO 1
 
 // errors
 #define ERR_THREAD_ALREADY_FIBER 100
@@ -65,6 +116,12 @@
 #define ERR_FIBER_ALREADY_RUNNING 400
 #define ERR_FLS_FULL 500
 #define ERR_FLS_INVALID_INDEX 600
+#define ERR_NO_IDLE_FIBER 700
+
+// the fiber never uses floating point or SIMD registers, they are not switched for it
+#define FIBER_FLAG_NOFPU 1
+// all the flags that can be passed when creating a fiber
+#define FIBER_FLAGS (FIBER_FLAG_NOFPU)
 
 /**
  * @brief Params to be passed by the library when creating or converting to a fiber
@@ -76,8 +133,29 @@ typedef struct fiber_params {
     unsigned long function; /**< The function pointer passed by the user, that will be the starting
                                point of the fiber */
     unsigned long function_args; /**< Pointer to params for fiber_params::function */
+    unsigned long flags;         /**< FIBER_FLAG_* */
 } fiber_params_t;
 
+/*
+ * Fiber local storage
+ * The indexes of the local storage are allocated for all the fibers of a domain, every fiber has its
+ * own value for each index. The device can be mapped with a shared `mmap`, the mapping exposes:
+ * - at offset 0, the bitmap of the allocated indexes of the domain of the file, in FLS_MAP_BITMAP_SIZE
+ * bytes;
+ * - at offset FLS_MAP_BITMAP_SIZE + i * FLS_MAP_SIZE, the MAX_FLS values (long) of the fiber with
+ * index i, see FIBER_FID_INDEX.
+ */
+// the number of cells of the local storage
+#define MAX_FLS 4096
+// the values of a fiber are allocated in chunks of this size, the first time they are used
+#define FLS_CHUNK_SIZE 4096
+#define FLS_CHUNK_CELLS (FLS_CHUNK_SIZE / sizeof(long))
+#define FLS_CHUNKS (MAX_FLS / FLS_CHUNK_CELLS)
+// the size of the bitmap of the allocated indexes in the mapping
+#define FLS_MAP_BITMAP_SIZE 4096
+// the size of the values of a fiber in the mapping
+#define FLS_MAP_SIZE (FLS_CHUNKS * FLS_CHUNK_SIZE)
+
 /**
  * @brief Params to be passed by the library when setting a value in its fiber local storage
  *
@@ -87,4 +165,85 @@ typedef struct fls_params {
     long value; /**< Value to be associated with that index*/
 } fls_params_t;
 
+/*
+ * Batches
+ * A batch runs an array of operations in a single call of the device, they are executed in order
+ * and the batch stops at the first one that fails. A switch can only be the last operation.
+ */
+#define FIBER_BATCH_CREATE 0
+#define FIBER_BATCH_FLS_GET 1
+#define FIBER_BATCH_FLS_SET 2
+#define FIBER_BATCH_SWITCH 3
+// the operations are copied from user space in groups of this size
+#define FIBER_BATCH_CHUNK 64
+
+/**
+ * @brief An operation of a batch
+ *
+ */
+typedef struct fiber_batch_op {
+    unsigned op; /**< The operation, one of FIBER_BATCH_* */
+    long ret;    /**< Set by the kernel to the result of the operation, as the single call would
+                    return it */
+    union {
+        fiber_params_t create; /**< The params for FIBER_BATCH_CREATE */
+        fls_params_t fls; /**< The params for FIBER_BATCH_FLS_GET and FIBER_BATCH_FLS_SET, the value
+                             is filled by FIBER_BATCH_FLS_GET */
+        unsigned long fid; /**< The fiber for FIBER_BATCH_SWITCH */
+    };
+} fiber_batch_op_t;
+
+/**
+ * @brief Params to be passed by the library when running a batch of operations
+ *
+ */
+typedef struct fiber_batch_params {
+    unsigned long ops;   /**< Pointer to an array of fiber_batch_op_t */
+    unsigned long count; /**< The number of operations in the array */
+} fiber_batch_params_t;
+
+/*
+ * Snapshots
+ * A snapshot copies the statistics of the fibers of a process in an array of fixed size records,
+ * ordered by fiber slot, see FIBER_FID_SLOT, the same data that is shown in the files of
+ * /proc/<pid>/fibers.
+ */
+// fiber_snapshot_params::next when all the fibers have been copied
+#define FIBER_SNAPSHOT_END (~0UL)
+// the records are copied to user space in groups of this size
+#define FIBER_SNAPSHOT_CHUNK 64
+
+/**
+ * @brief The statistics of a fiber in a snapshot
+ *
+ */
+typedef struct fiber_snapshot {
+    unsigned id;                          /**< The id of the fiber */
+    unsigned state;                       /**< 0 if idle, 1 if running */
+    int run_by;                           /**< The thread running the fiber, or that ran it last */
+    int created_by;                       /**< The thread that created the fiber */
+    unsigned long flags;                  /**< FIBER_FLAG_* */
+    unsigned long entry_point;            /**< The starting function of the fiber */
+    unsigned success_activations;         /**< Number of successful activations */
+    unsigned failed_activations;          /**< Number of failed activations */
+    unsigned long long total_time;        /**< Running time in ns */
+    unsigned long long cpu_time;          /**< Time on a cpu in ns, until the last switch */
+    unsigned long long cycles;            /**< Hardware counters, see FIBER_IOC_PERF */
+    unsigned long long instructions;
+    unsigned long long cache_misses;
+} fiber_snapshot_t;
+
+/**
+ * @brief Params to be passed by the library when taking a snapshot
+ *
+ */
+typedef struct fiber_snapshot_params {
+    long pid;              /**< The process, 0 for the calling one */
+    unsigned long records; /**< Pointer to an array of fiber_snapshot_t */
+    unsigned long count;   /**< The number of records of the array */
+    unsigned long next; /**< The lowest fiber slot to copy, set by the kernel to the slot to start
+                           from for the fibers that did not fit in the array, or
+                           FIBER_SNAPSHOT_END */
+} fiber_snapshot_params_t;
+
 #endif
\ No newline at end of file
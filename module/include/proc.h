@@ -39,6 +39,18 @@
 
 #define PROC_FOLDER "fibers"
 #define PROC_ENTRY "fiber"
+#define PROC_HASHTABLE_ENTRY "hashtable"
+#define PROC_STAT_ENTRY "stat"
+// the file of /proc/fibers/<PID> with all the fibers of the process
+#define PROC_PROCESS_FIBERS_ENTRY "fibers"
+// the file with the aggregate figures of a process, in /proc/<PID>/fibers and /proc/fibers/<PID>
+#define PROC_SUMMARY_ENTRY "summary"
+// the histogram of the latency of the switches of a process, in the same directories
+#define PROC_LATENCY_ENTRY "latency"
+// the number of entries arrays of proc_pident_readdir that are extended once and kept
+#define PROC_PIDENT_CACHE_SIZE 4
+// the size of the name of a /proc/<PID>/fibers/<FID> file, a fiber id in decimal
+#define PROC_FIBER_NAME_SIZE 16
 
 union proc_op {
     int (*proc_get_link)(struct dentry *, struct path *);
@@ -55,6 +67,18 @@ struct pid_entry {
     union proc_op op;
 };
 
+/**
+ * @brief An array of entries of a /proc/<PID> directory extended with the `fibers` directory
+ *
+ * The arrays passed to @c proc_pident_readdir are static tables of proc, so they are extended only
+ * once each and kept until the module is unloaded.
+ */
+typedef struct pident_ext {
+    const struct pid_entry *ents; /**< The original array */
+    unsigned int nents;           /**< The number of entries of the original array */
+    struct pid_entry ext[];       /**< The original entries followed by the `fibers` one */
+} pident_ext_t;
+
 struct ftrace_hook {
     const char *name;
     void *function;
@@ -90,6 +114,8 @@ struct ftrace_hook {
 
 int init_proc(void);
 void destroy_proc(void);
+void proc_register_process(fibered_process_node_t *fibered_process_node);
+void proc_unregister_process(fibered_process_node_t *fibered_process_node);
 
 int fh_install_hook(struct ftrace_hook *hook);
 void fh_remove_hook(struct ftrace_hook *hook);
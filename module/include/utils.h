@@ -29,7 +29,9 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <linux/hashtable.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
 
 /**
  * @brief Create a list entry of the `type` specified and assign it to new and head (if head is
@@ -100,4 +102,38 @@
         }                                                                                          \
     }
 
-#endif
\ No newline at end of file
+/**
+ * @brief Same as @ref check_if_exists but for a list modified with the RCU primitives, must be
+ * called in a RCU read-side critical section or holding the lock of the writers
+ *
+ */
+#define check_if_exists_rcu(result, head, field, value, member, type)                              \
+    result = NULL;                                                                                 \
+    {                                                                                              \
+        type *type_temp__ = NULL;                                                                  \
+        list_for_each_entry_rcu(type_temp__, head, member) {                                       \
+            if (type_temp__->field == value) {                                                     \
+                result = type_temp__;                                                              \
+                break;                                                                             \
+            }                                                                                      \
+        }                                                                                          \
+    }
+
+/**
+ * @brief Same as @ref check_if_exists_hash but for a hash table modified with the RCU primitives,
+ * must be called in a RCU read-side critical section or holding the lock of the writers
+ *
+ */
+#define check_if_exists_hash_rcu(result, hashtable, field, value, member, type)                    \
+    result = NULL;                                                                                 \
+    {                                                                                              \
+        type *__cursor_temp_hash = NULL;                                                           \
+        hash_for_each_possible_rcu(hashtable, __cursor_temp_hash, member, value) {                 \
+            if (__cursor_temp_hash->field == value) {                                              \
+                result = __cursor_temp_hash;                                                       \
+                break;                                                                             \
+            }                                                                                      \
+        }                                                                                          \
+    }
+
+#endif
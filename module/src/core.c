@@ -29,62 +29,170 @@
  */
 
 #include "core.h"
+#include "proc.h"
+
+#define CREATE_TRACE_POINTS
+#include "fiber_trace.h"
+
+/*
+ * Static functions
+ */
+static int bind_fiber_domain(struct file *filp);
+static void unbind_fiber_domain(struct file *filp);
+static void destroy_fiber_domain(struct rcu_head *rcu);
+static void destroy_fibered_process(struct rcu_head *rcu);
+static fiber_domain_t *get_fiber_domain(struct file *filp);
+static int create_fiber_kern(struct file *filp, fiber_params_t *params_kern);
+static long fls_get_kern(struct file *filp, fls_params_t *params_kern);
+static int fls_set_kern(struct file *filp, fls_params_t *params_kern);
+static void switch_fiber_context(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                                 fiber_node_t *current_fiber_node,
+                                 fiber_node_t *requested_fiber_node);
+static void make_fiber_ready(fiber_domain_t *domain, fiber_node_t *fiber_node);
+static void account_latency(fiber_domain_t *domain, cycles_t start_cycles);
+static fiber_node_t *claim_ready_fiber(fiber_domain_t *domain);
+static void account_switch(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                           fiber_node_t *current_fiber_node, fiber_node_t *requested_fiber_node);
+static bool install_thread_perf(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                                fiber_perf_t **spare_perf);
+static void account_perf(fiber_domain_t *domain, fiber_perf_t *perf,
+                         fiber_node_t *current_fiber_node);
+static fiber_perf_t *alloc_fiber_perf(void);
+static void release_fiber_perf(fiber_perf_t *perf);
+static void release_fiber_perf_work(struct work_struct *work);
+static fiber_node_t *alloc_fiber_node(void);
+static void free_fiber_node(fiber_node_t *fiber_node);
+static void release_fiber_node(fiber_node_t *fiber_node);
+static void destroy_fiber(struct rcu_head *rcu);
+static unsigned get_fiber_generation(fiber_domain_t *domain, unsigned index);
+static unsigned long fiber_cache_count(struct shrinker *shrinker, struct shrink_control *sc);
+static unsigned long fiber_cache_scan(struct shrinker *shrinker, struct shrink_control *sc);
 
 /*
  * Variables
  */
-static struct kprobe kp;
 
 /**
  * @brief The variable of the core part that will contain the **fiber-enabled** processes
  */
+fibered_processes_list_t fibered_processes_list;
+
+/**
+ * @brief Parameters of fibered_processes_list::hash_table, processes are keyed by their pid
+ */
 // clang-format off
-fibered_processes_list_t fibered_processes_list = {
-#ifdef USE_HASH_LIST
-    .hash_table = {[0 ...((1 << (HASH_KEY_SIZE)) - 1)] = HLIST_HEAD_INIT},
-#else
-    .list = LIST_HEAD_INIT(fibered_processes_list.list),
-#endif
-    .processes_count = 0
+static const struct rhashtable_params fibered_processes_params = {
+    .key_len = sizeof(pid_t),
+    .key_offset = offsetof(fibered_process_node_t, pid),
+    .head_offset = offsetof(fibered_process_node_t, hnode),
+    .automatic_shrinking = true
 };
 // clang-format on
 
-DEFINE_SPINLOCK(fiber_spinlock);
-unsigned long irq_flags;
+/**
+ * @brief Serializes the binding of the domains to the processes and the writers of
+ * @ref fibered_processes_list
+ */
+static DEFINE_MUTEX(fibered_processes_mutex);
 
-/*
- * Kprobe implementation
+/**
+ * @brief The period of the statistics of the new domains, see fiber_domain::stats_period
  */
-int pre_exit_handler(struct kprobe *p, struct pt_regs *regs) {
-    exit_fibered();
-    // printk(KERN_DEBUG MODULE_NAME CORE_LOG "pre_exit_handler called by tgid %d",
-    // current->tgid);
+static unsigned stats_period = 1;
+module_param(stats_period, uint, 0644);
+MODULE_PARM_DESC(stats_period, "Statistics of the fibers of new domains: 0 disabled, 1 at every "
+                               "switch, N at one switch every N");
 
-    return 0;
-}
-void post_exit_handler(struct kprobe *p, struct pt_regs *regs, unsigned long flags) {
-    // printk(KERN_DEBUG MODULE_NAME CORE_LOG "pre_exit_handler called");
-}
+/**
+ * @brief Enabled while at least one domain collects statistics, so that the switches do not even
+ * check fiber_domain::stats_period when no domain does
+ */
+static DEFINE_STATIC_KEY_FALSE(fiber_stats_enabled);
+
+/**
+ * @brief The counters of the operations of all the processes, per cpu
+ */
+static DEFINE_PER_CPU(fiber_counters_t, fiber_counters);
+// adds one to a counter of this cpu, the caller can be preempted
+#define fiber_count(field) this_cpu_inc(fiber_counters.field)
+
+/**
+ * @brief The slab cache of the fiber nodes, that are too big for sharing the generic caches
+ */
+static struct kmem_cache *fiber_cache;
+
+/**
+ * @brief The fiber nodes that have been freed on a cpu, they are reused by the next fibers
+ * created on the same cpu before going back to @ref fiber_cache
+ */
+static DEFINE_PER_CPU(fiber_cache_cpu_t, fiber_cache_cpus);
+
+/**
+ * @brief Releases the fiber nodes kept in @ref fiber_cache_cpus when the memory is low
+ */
+// clang-format off
+static struct shrinker fiber_cache_shrinker = {
+    .count_objects = fiber_cache_count,
+    .scan_objects = fiber_cache_scan,
+    .seeks = DEFAULT_SEEKS
+};
+// clang-format on
 
 /**
  * @brief Init the core module
  *
  */
 int init_core() {
-    // Initalize the kprobe handler
-    kp.pre_handler = pre_exit_handler;
-    kp.post_handler = post_exit_handler;
-    kp.addr = (kprobe_opcode_t *)kallsyms_lookup_name("do_exit");
-    // de-comment the following line to register the kbrobe
-    register_kprobe(&kp);
+    fiber_cache_cpu_t *cache_cpu;
+    int cpu, ret;
+
+    // the chunks of the local storage and its bitmap are mapped as single pages
+    BUILD_BUG_ON(FLS_CHUNK_SIZE != PAGE_SIZE || FLS_MAP_BITMAP_SIZE != PAGE_SIZE);
+    BUILD_BUG_ON(MAX_FLS / 8 > FLS_MAP_BITMAP_SIZE);
+    // the hot header of the fibers and the statistics, see fiber_node_t
+    BUILD_BUG_ON(offsetof(fiber_node_t, regs) > L1_CACHE_BYTES);
+    BUILD_BUG_ON(offsetof(fiber_node_t, cpu_time_last_switch) + sizeof(u64) -
+                     offsetof(fiber_node_t, success_activations_count) >
+                 L1_CACHE_BYTES);
+    // the fiber nodes, aligned as required by the xsave area of fiber::fpu_regs
+    fiber_cache = kmem_cache_create("fiber_node", sizeof(fiber_node_t),
+                                    __alignof__(fiber_node_t), SLAB_HWCACHE_ALIGN, NULL);
+    if (fiber_cache == NULL) return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        cache_cpu = per_cpu_ptr(&fiber_cache_cpus, cpu);
+        spin_lock_init(&cache_cpu->lock);
+        INIT_LIST_HEAD(&cache_cpu->free);
+        cache_cpu->count = 0;
+    }
+    ret = register_shrinker(&fiber_cache_shrinker);
+    if (ret < 0) goto err_shrinker;
+    // Initialize the table of fibered processes
+    ret = rhashtable_init(&fibered_processes_list.hash_table, &fibered_processes_params);
+    if (ret < 0) goto err_table;
     return 0;
+
+err_table:
+    unregister_shrinker(&fiber_cache_shrinker);
+err_shrinker:
+    kmem_cache_destroy(fiber_cache);
+    return ret;
 }
 
 /**
  * @brief Destroy the core module
  *
  */
-void destroy_core() { unregister_kprobe(&kp); }
+void destroy_core() {
+    struct shrink_control sc = {.nr_to_scan = ULONG_MAX};
+
+    // wait for the pending frees of the released domains, and for the counters they released
+    rcu_barrier();
+    flush_scheduled_work();
+    rhashtable_destroy(&fibered_processes_list.hash_table);
+    unregister_shrinker(&fiber_cache_shrinker);
+    fiber_cache_scan(&fiber_cache_shrinker, &sc);
+    kmem_cache_destroy(fiber_cache);
+}
 
 /*
  * Implementations
@@ -95,22 +203,22 @@ void destroy_core() { unregister_kprobe(&kp); }
  *
  * # Implementation
  * When a thread is converted to a fiber several tasks are performed. First of all, we must
- * check if the process if *fiber-enabled* or not by searching if its `pid` (so even its `tgid`)
- * is already present in the fibered_processes_list, that must be initialized if it is the case.
- *
- * ## Process not **fiber-enabled**
- * If the process never created a fiber, it must become **fiber-enabled**, this means that we
- * have to instantiate a fibered_process element in the @ref fibered_processes_list variable.
- * Then we have to instantiate a @ref fiber element in the fibers_list field of the
- * fibered_process element of the list.
- *
- * ## Process **fiber-enabled**
- * If the process is already a *fiber-enabled* then we have just to append a new @ref fiber
- * entry to the fibered_process::fibers_list. This requires that the parameters are also set
+ * check if the file @p filp already has a @ref fiber_domain, that must be created if it is not the
+ * case.
+ *
+ * ## File without domain
+ * If no thread has been converted through the file, a new @ref fiber_domain is created and the
+ * process becomes **fiber-enabled** if it was not already, this means that we have to instantiate
+ * a fibered_process element in the @ref fibered_processes_list variable. Then we have to
+ * instantiate a @ref fiber element in the fibers_list field of the domain.
+ *
+ * ## File with domain
+ * If the file already has a domain then we have just to append a new @ref fiber
+ * entry to the fiber_domain::fibers_list. This requires that the parameters are also set
  * according to the ones that are passed to the function as @p params argument. At the end a new
  * proc file must be created in the directory `/proc/<pid>/fibers/<fid>`. The fields of the
  * fiber element are set in this way:
- * - fiber::id is set to the current number of fibers -1;
+ * - fiber::id is set to the first free id in the fibers_list::fibers_idr index;
  * - fiber::regs is set with the function `task_pt_regs(current)`;
  * - fiber::entry_point is set to fiber::regs::ip;
  * - fiber::state is set to fiber_state::RUNNING;
@@ -118,62 +226,102 @@ void destroy_core() { unregister_kprobe(&kp); }
  * - fiber::run_by is set to to `current->pid`;
  * - fiber::success_activations_count is set to 1 if success else 0;
  * - fiber::failed_activations_count is set to 1 if fail else 0;
- * - fiber::total_time is set to 0;
+ * - fiber::total_time and fiber::cpu_time are set to 0, the clocks are started now;
  * - fiber::base_user_stack_addr is ignored - because the stack address is saved in `regs`;
  *
+ * The fibers live in the @ref fiber_domain of the file @p filp of the device, that is created by the
+ * first conversion made through the file, see @ref bind_fiber_domain, and released together with
+ * it, see @ref release_fibered. The fiber::id is the index of the fiber in the domain combined with
+ * fiber_domain::id and the generation of the index, see @ref FIBER_FID.
+ *
+ * @param filp the file of the device opened by the process
  * @return int the id of the newly created fiber otherwise `ERR_THREAD_ALREADY_FIBER` if the
- * thread already has been converted to a fiber
+ * thread already has been converted to a fiber, `EBADF` if the file belongs to another process
  */
-int convert_thread_to_fiber() {
-    fibered_process_node_t *fibered_process_node;
+int convert_thread_to_fiber(struct file *filp) {
+    fiber_domain_t *domain;
+    fibered_thread_node_t *fibered_thread_node;
     fiber_node_t *fiber_node;
     int ret;
 
-    // check if the thread is already a fiber
-    // check if process if fiber enabled
-    // check if process already created at least a fiber
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
-// process has never created a fiber
-#ifdef USE_HASH_LIST
-        create_hash_entry(fibered_process_node, fibered_process_node_t,
-                          fibered_processes_list.hash_table, &fibered_process_node->hlist,
-                          current->tgid);
-#else
-        create_list_entry(fibered_process_node, &fibered_processes_list.list, list,
-                          fibered_process_node_t);
-#endif
-        fibered_processes_list.processes_count++;
-        fibered_process_node->pid = current->tgid;
-        INIT_LIST_HEAD(&fibered_process_node->fibers_list.list);
-        fibered_process_node->fibers_list.fibers_count = 0;
+    // allocate everything before taking any lock, what is not used is released at the end
+    fibered_thread_node = kmalloc(sizeof(fibered_thread_node_t), GFP_KERNEL);
+    fiber_node = alloc_fiber_node();
+    if (fibered_thread_node == NULL || fiber_node == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    // the fiber is not visible to other threads until it is indexed
+    fiber_node->created_by = current->pid;
+    fiber_node->run_by = current->pid;
+    memcpy(&fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
+    // -> FPU regs, they are live in the cpu and saved by the first switch
+    memset(&fiber_node->fpu_regs, 0, offsetof(struct fpu, state));
+    fpstate_init(&fiber_node->fpu_regs.state);
+    // -> general purpose
+    fiber_node->entry_point = fiber_node->regs.ip;
+    fiber_node->success_activations_count = 1;
+    atomic_set(&fiber_node->failed_activations_count, 0);
+    fiber_node->total_time = 0;
+    fiber_node->time_last_switch = ktime_get_ns();
+    fiber_node->cpu_time = 0;
+    preempt_disable();
+    fiber_node->cpu_time_last_switch = get_current_cpu_time();
+    preempt_enable();
+    fiber_node->state = RUNNING;
+    fiber_node->flags = 0;
+    INIT_LIST_HEAD(&fiber_node->ready);
+    memset(&fiber_node->local_storage, 0, sizeof(fiber_local_storage_t));
+    memset(fiber_node->perf_counts, 0, sizeof(fiber_node->perf_counts));
+    fibered_thread_node->pid = current->pid;
+    fibered_thread_node->running_fiber = fiber_node;
+    fibered_thread_node->switches = 0;
+    // the counters are created by the first switch that collects them, see install_thread_perf
+    fibered_thread_node->perf = NULL;
+
+    mutex_lock(&fibered_processes_mutex);
+    // the domain of the file is created by the first conversion made through it
+    domain = filp->private_data;
+    if (domain == NULL) {
+        ret = bind_fiber_domain(filp);
+        if (ret < 0) goto out_unlock;
+        domain = filp->private_data;
+    } else if (domain->pid != current->tgid) {
+        // the file has been inherited from another fiber-enabled process
+        ret = -EBADF;
+        goto out_unlock;
     }
 
-    fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
-    if (fiber_node == NULL) {
-        // thread is not a fiber
-        create_list_entry(fiber_node, &fibered_process_node->fibers_list.list, list, fiber_node_t);
-        fiber_node->id = fibered_process_node->fibers_list.fibers_count;
-        fiber_node->created_by = current->pid;
-        fiber_node->run_by = current->pid;
-        // -> FPU regs
-        memcpy(&fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
-        memset(&fiber_node->fpu_regs, 0, sizeof(struct fpu));
-        // fpu__initialize(&fiber_node->fpu_regs);
-        copy_fxregs_to_kernel(&fiber_node->fpu_regs);
-        // -> general purpose
-        fiber_node->entry_point = fiber_node->regs.ip;
-        fiber_node->success_activations_count = 1;
-        fiber_node->failed_activations_count = 0;
-        fiber_node->total_time = 0;
-        getnstimeofday(&fiber_node->time_last_switch);
-        fiber_node->state = RUNNING;
-        fibered_process_node->fibers_list.fibers_count++;
-        bitmap_clear(fiber_node->local_storage.fls_bitmap, 0, MAX_FLS);
-        ret = fiber_node->id;
-    } else
+    idr_preload(GFP_KERNEL);
+    spin_lock(&domain->lock);
+    // check if the thread is already a fiber
+    if (check_if_thread_is_fibered(domain, current->pid) != NULL)
         ret = -ERR_THREAD_ALREADY_FIBER;
+    else
+        ret = idr_alloc(&domain->fibers_list.fibers_idr, NULL, 0, FIBER_MAX_FIBERS, GFP_NOWAIT);
+    if (ret >= 0) {
+        fiber_node->id =
+            FIBER_FID_WITH_GEN(FIBER_FID(domain->id, ret), get_fiber_generation(domain, ret));
+        idr_replace(&domain->fibers_list.fibers_idr, fiber_node, ret);
+        list_add_tail_rcu(&fiber_node->list, &domain->fibers_list.list);
+        domain->fibers_list.fibers_count++;
+        hash_add_rcu(domain->threads, &fibered_thread_node->hlist, current->pid);
+        domain->threads_count++;
+        trace_fiber_convert(fiber_node->id, fiber_node->entry_point);
+        fiber_count(conversions);
+        ret = fiber_node->id;
+        // now they belong to the domain
+        fiber_node = NULL;
+        fibered_thread_node = NULL;
+    }
+    spin_unlock(&domain->lock);
+    idr_preload_end();
+out_unlock:
+    mutex_unlock(&fibered_processes_mutex);
 
+out:
+    kfree(fibered_thread_node);
+    if (fiber_node != NULL) free_fiber_node(fiber_node);
     return ret;
 }
 
@@ -184,12 +332,13 @@ int convert_thread_to_fiber() {
  * First of all, only a thread that has been converted to a fiber can create fibers, so after this
  * check we have to create a @ref fiber element in the fibered_process::fibers_list and assign to it
  * the params that are passed in the @p params argument, so:
- * - fiber::id is set to the current number of fibers -1;
+ * - fiber::id is set to the first free id in the fibers_list::fibers_idr index;
  * - fiber::regs is set with the values of the @c pt_regs structure, after they have been obtained
- * with the function `task_pt_regs(current)`. In order to do this we have to allocate some kernel
- * memory using @c kmalloc;
+ * with the function `task_pt_regs(current)`. In order to do this we have to allocate the fiber,
+ * before taking any lock, see @ref alloc_fiber_node;
  * - fiber::starting_function is set to fiber::regs::ip;
- * - fiber::state is set to fiber_state::IDLE;
+ * - fiber::state is set to fiber_state::IDLE, and the fiber is appended to
+ * fiber_domain::ready_queue;
  * - fiber::run_by is set to -1, indicating that no thread is running the fiber
  * - fiber::base_user_stack_addr is set to fiber_params::stack_addr - for setting the stack base
  * address
@@ -198,20 +347,21 @@ int convert_thread_to_fiber() {
  * - fiber::regs::di is set to fiber_params::function_args - for setting the first parameter of the
  * function that the user passed as starting point of the fiber
  * - fiber::created_by is set to `current->pid`;
- * - fiber::local_storage::fls_bitmap is cleared;
+ * - fiber::flags is set to fiber_params::flags, that must be a combination of @ref FIBER_FLAGS;
+ * - fiber::local_storage is cleared, no chunk of values is allocated;
  * - fiber::success_activations_count is set 0;
  * - fiber::failed_activations_count is set 0;
- * - fiber::total_time is set to 0;
+ * - fiber::total_time and fiber::cpu_time are set to 0, the clocks are started by the first switch
+ * to the fiber;
  *
  * At the end a proc directory is created in `/proc/<pid>/fibers/<fid>`.
  *
+ * @param filp the file of the device, the fiber is created in its @ref fiber_domain
  * @param params
  * @return int the id of the newly created fiber otherwise ERR_NOT_FIBERED if the thread is not
- * *fiber-enabled*
+ * *fiber-enabled*, EINVAL if the flags are unknown
  */
-int create_fiber(fiber_params_t *params) {
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *fiber_node;
+int create_fiber(struct file *filp, fiber_params_t *params) {
     fiber_params_t params_kern;
     int ret;
     ret = copy_from_user(&params_kern, params, sizeof(fiber_params_t));
@@ -220,62 +370,218 @@ int create_fiber(fiber_params_t *params) {
                ret);
         return -EFAULT;
     }
+    return create_fiber_kern(filp, &params_kern);
+}
+
+/**
+ * @brief Create a new fiber from params that are already in kernel memory
+ *
+ * The implementation of @ref create_fiber, shared with @ref run_batch.
+ *
+ * @param filp the file of the device, the fiber is created in its @ref fiber_domain
+ * @param params_kern the params of the fiber, in kernel memory
+ * @return int the id of the newly created fiber, or an error as @ref create_fiber
+ */
+static int create_fiber_kern(struct file *filp, fiber_params_t *params_kern) {
+    fiber_domain_t *domain;
+    fiber_node_t *fiber_node;
+    int ret;
+
+    if (params_kern->flags & ~FIBER_FLAGS) return -EINVAL;
+    // the node is allocated and set before taking any lock, it is not visible to other threads
+    // until it is indexed
+    fiber_node = alloc_fiber_node();
+    if (fiber_node == NULL) return -ENOMEM;
+    memset(&fiber_node->local_storage, 0, sizeof(fiber_local_storage_t));
+    memset(fiber_node->perf_counts, 0, sizeof(fiber_node->perf_counts));
+    fiber_node->created_by = current->pid;
+    fiber_node->run_by = -1; // meaning no thread is running it
+    fiber_node->state = IDLE;
+    fiber_node->flags = params_kern->flags;
+    INIT_LIST_HEAD(&fiber_node->ready);
+    // -> Set the registers
+    memcpy(&fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
+    // -> FPU registers, the fiber starts with every component in its init state
+    memset(&fiber_node->fpu_regs, 0, offsetof(struct fpu, state));
+    fpstate_init(&fiber_node->fpu_regs.state);
+    fiber_node->regs.ip = params_kern->function;
+    fiber_node->regs.di = params_kern->function_args;
+    fiber_node->regs.sp = params_kern->stack_addr;
+    fiber_node->regs.bp = params_kern->stack_addr;
+    fiber_node->base_user_stack_addr = params_kern->stack_addr;
+    // -> Save as reference
+    fiber_node->entry_point = params_kern->function;
+    fiber_node->success_activations_count = 0;
+    atomic_set(&fiber_node->failed_activations_count, 0);
+    fiber_node->total_time = 0;
+    fiber_node->time_last_switch = 0;
+    fiber_node->cpu_time = 0;
 
+    idr_preload(GFP_KERNEL);
+    rcu_read_lock();
     // check if process if fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
 
     // check if the thread is a fiber
-    fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
     // if (fiber_node == NULL) printk(KERN_ALERT "Thread %d is not a fiber", current->pid);
-    if (fiber_node == NULL) {
+    if (check_if_this_thread_is_fiber(domain) == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
     // add the node
+    spin_lock(&domain->lock);
+    ret = idr_alloc(&domain->fibers_list.fibers_idr, NULL, 0, FIBER_MAX_FIBERS, GFP_NOWAIT);
+    if (ret >= 0) {
+        fiber_node->id =
+            FIBER_FID_WITH_GEN(FIBER_FID(domain->id, ret), get_fiber_generation(domain, ret));
+        // the fiber is queued before it can be claimed by its id, see make_fiber_ready
+        spin_lock(&domain->rq_lock);
+        idr_replace(&domain->fibers_list.fibers_idr, fiber_node, ret);
+        list_add_tail(&fiber_node->ready, &domain->ready_queue);
+        spin_unlock(&domain->rq_lock);
+        list_add_tail_rcu(&fiber_node->list, &domain->fibers_list.list);
+        domain->fibers_list.fibers_count++;
+        trace_fiber_create(fiber_node->id, fiber_node->entry_point);
+        fiber_count(creations);
+        ret = fiber_node->id;
+    }
+    spin_unlock(&domain->lock);
 
-    create_list_entry(fiber_node, &fibered_process_node->fibers_list.list, list, fiber_node_t);
-    fiber_node->id = fibered_process_node->fibers_list.fibers_count;
-    fiber_node->created_by = current->pid;
-    fiber_node->run_by = -1; // meaning no thread is running it
-    fiber_node->state = IDLE;
-    // -> Set the registers
-    memcpy(&fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
-    // -> FPU registers
-    memset(&fiber_node->fpu_regs, 0, sizeof(struct fpu));
-    // fpu__initialize(&fiber_node->fpu_regs);
-    copy_fxregs_to_kernel(&fiber_node->fpu_regs);
-    fiber_node->regs.ip = params_kern.function;
-    fiber_node->regs.di = params_kern.function_args;
-    fiber_node->regs.sp = params_kern.stack_addr;
-    fiber_node->regs.bp = params_kern.stack_addr;
-    fiber_node->base_user_stack_addr = params_kern.stack_addr;
-    // -> Save as reference
-    fiber_node->entry_point = params_kern.function;
-    fibered_process_node->fibers_list.fibers_count++;
-    fiber_node->success_activations_count = 0;
-    fiber_node->failed_activations_count = 0;
-    fiber_node->total_time = 0;
-    bitmap_clear(fiber_node->local_storage.fls_bitmap, 0, MAX_FLS);
-    ret = fiber_node->id;
+err_precheck:
+    rcu_read_unlock();
+    idr_preload_end();
+    if (ret < 0) free_fiber_node(fiber_node);
+    return ret;
+}
+
+/**
+ * @brief Delete a fiber of the domain of the file
+ *
+ * # Implementation
+ * The fiber is claimed like in @ref switch_to_fiber, so a fiber that is running, included the one
+ * of the calling thread, cannot be deleted. Then it is removed from the ready queue and from
+ * fibers_list::list, and its entry of fibers_list::fibers_idr is replaced by NULL: the fiber is
+ * not found anymore, but the index stays reserved. Its local storage is unmapped from the file
+ * after dropping the locks, since unmapping can sleep, and only then the index is removed, so the
+ * next fiber created with it never sees the pages of this one. @ref fibered_processes_mutex is
+ * held for the whole deletion, so the domain is not unbound in the middle.
+ *
+ * The generation of the index is incremented, so the new fiber has another id and the stale id of
+ * the deleted fiber is not found anymore, see @ref check_if_fiber_exist. The generations are per
+ * index, so an id becomes valid again only after @ref FIBER_MAX_GENS deletions of the fibers of
+ * the same index. Their page is allocated before taking any lock, and released if
+ * the chunk of the index already had one.
+ *
+ * The fiber is freed by @ref destroy_fiber when the readers that could have found it are done,
+ * the pages of its local storage that are still mapped are kept by the mappings until the unmap.
+ *
+ * @param filp the file of the device, the fiber must belong to its @ref fiber_domain
+ * @param fid the id of the fiber to delete
+ * @return int 0 if everything went OK, otherwise:
+ * - ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
+ * - ERR_FIBER_NOT_EXISTS if the fiber is not existing, or it has already been deleted
+ * - ERR_FIBER_ALREADY_RUNNING if the fiber is running
+ * - ENOMEM if the generations of the index cannot be allocated
+ */
+int delete_fiber(struct file *filp, unsigned fid) {
+    fiber_domain_t *domain;
+    fiber_node_t *fiber_node;
+    u8 *generations, *spare_generations;
+    unsigned index = FIBER_FID_INDEX(fid);
+    int ret = 0;
+
+    // allocate before taking any lock, what is not used is released at the end
+    spare_generations = (u8 *)get_zeroed_page(GFP_KERNEL);
+    if (spare_generations == NULL) return -ENOMEM;
+    mutex_lock(&fibered_processes_mutex);
+    idr_preload(GFP_KERNEL);
+    rcu_read_lock();
+    domain = get_fiber_domain(filp);
+    if (domain == NULL || check_if_thread_is_fibered(domain, current->pid) == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+    spin_lock(&domain->lock);
+    fiber_node = check_if_fiber_exist(domain, fid);
+    if (fiber_node == NULL) {
+        ret = -ERR_FIBER_NOT_EXISTS;
+        goto out_unlock;
+    }
+    // the generations of the chunk of the index, installed by the first deletion in it
+    generations = idr_find(&domain->fibers_list.generations, index / FIBER_GEN_CHUNK);
+    if (generations == NULL) {
+        ret = idr_alloc(&domain->fibers_list.generations, spare_generations,
+                        index / FIBER_GEN_CHUNK, index / FIBER_GEN_CHUNK + 1, GFP_NOWAIT);
+        if (ret < 0) goto out_unlock;
+        generations = spare_generations;
+        spare_generations = NULL;
+        ret = 0;
+    }
+    // claim the fiber, so no thread can switch to it anymore
+    if (cmpxchg(&fiber_node->state, IDLE, RUNNING) != IDLE) {
+        ret = -ERR_FIBER_ALREADY_RUNNING;
+        goto out_unlock;
+    }
+    spin_lock(&domain->rq_lock);
+    list_del_init(&fiber_node->ready);
+    spin_unlock(&domain->rq_lock);
+    // the index stays reserved until its local storage is unmapped, see below
+    idr_replace(&domain->fibers_list.fibers_idr, NULL, index);
+    list_del_rcu(&fiber_node->list);
+    domain->fibers_list.fibers_count--;
+    generations[index % FIBER_GEN_CHUNK]++;
+    call_rcu(&fiber_node->rcu, destroy_fiber);
+    fiber_count(deletions);
+out_unlock:
+    spin_unlock(&domain->lock);
 
 err_precheck:
+    rcu_read_unlock();
+    idr_preload_end();
+    if (spare_generations != NULL) free_page((unsigned long)spare_generations);
+    // the next fiber with the same index must not see the local storage of this one
+    if (ret == 0) {
+        unmap_mapping_range(filp->f_mapping, FLS_MAP_BITMAP_SIZE + (loff_t)index * FLS_MAP_SIZE,
+                            FLS_MAP_SIZE, 1);
+        spin_lock(&domain->lock);
+        idr_remove(&domain->fibers_list.fibers_idr, index);
+        spin_unlock(&domain->lock);
+    }
+    mutex_unlock(&fibered_processes_mutex);
     return ret;
 }
 
+/**
+ * @brief Get the generation of an index of a domain, that the fiber created in it takes in its id
+ *
+ * The generation is incremented by every deletion of the fiber of the index, see
+ * @ref delete_fiber, it is 0 for the chunks of indexes that never had a deletion. Must be called
+ * holding fiber_domain::lock.
+ *
+ * @param domain the domain of the fiber
+ * @param index the index of the fiber in fibers_list::fibers_idr
+ * @return unsigned the generation, to be masked by @ref FIBER_FID_WITH_GEN
+ */
+static unsigned get_fiber_generation(fiber_domain_t *domain, unsigned index) {
+    u8 *generations = idr_find(&domain->fibers_list.generations, index / FIBER_GEN_CHUNK);
+
+    return generations == NULL ? 0 : generations[index % FIBER_GEN_CHUNK];
+}
+
 /**
  * @brief Switch to a chosen fiber
  *
+ * @param filp the file of the device, the fiber must belong to its @ref fiber_domain
  * @param fid
  *
  * #Implementation
  * Before starting the actual function, we have to do some checks:
- * 1. Check if there exists a process in the @ref fibered_processes_list, which means there
- * exists a process with pid equal to the tgid of the thread (this means that the processes
- * is _fibered-enabled_)
+ * 1. Check if the file @p filp has a @ref fiber_domain that belongs to the process of the thread
+ * (this means that the processes is _fibered-enabled_)
  * 2. Check if the @c pid of the currently running thread is present in at least one of @ref
  * fibered_process::fibers_list::fiber::created_by, this means that this thread has called
  * @ref
@@ -285,237 +591,917 @@ err_precheck:
  *
  * The context of the currently running fiber has to be saved. This means:
  * - the @c pt_regs structure has to be saved to the current @ref fiber::regs
- * - FPU register are saved in the field @ref fiber::fpu_regs with the functions `fpu__save` and
- * `fpu__restore`
+ * - FPU registers are saved in the field @ref fiber::fpu_regs with `copy_fpregs_to_fpstate` and
+ * restored with `copy_kernel_to_fpregs`, that use the xsave instructions of the cpu, so the whole
+ * extended state (SSE, AVX, AVX-512...) is switched. The cpu does not copy the components that
+ * are in their init state or that have not been modified since they were restored. The
+ * registers of a fiber created with @ref FIBER_FLAG_NOFPU are neither saved nor restored, so a
+ * switch between two of them does not touch the FPU at all
  *
  * Afterwards we'll get replace the current @c pt_regs structure with the one previously
  * saved.
  *
+ * All the lookups are done under RCU and the requested fiber is claimed by atomically moving its
+ * fiber::state from fiber_state::IDLE to fiber_state::RUNNING, so only one thread can win it. Then
+ * the fiber is removed from fiber_domain::ready_queue, that is the only lock taken on this path.
+ * The current fiber is moved back to fiber_state::IDLE, and queued, only after its context has
+ * been completely saved, see @ref make_fiber_ready, so fibers of the same process switch in
+ * parallel.
+ *
  * @return int 0 if everything went OK, otherwise:
  * - ERR_NOT_FIBERED if the the process is not fibered enabled, which means that none of its
  * threads has ever called @ref convert_thread_to_fiber
  * - ERR_NOT_FIBERED if the thread has never done @ref convert_thread_to_fiber
  * - ERR_FIBER_NOT_EXISTS if the fiber is not existing
  * - ERR_FIBER_ALREADY_RUNNING if the fiber is already running by another thread
+ *
+ * While the domain collects statistics, the cycles taken by every successful switch, from the call
+ * to the replacement of the context, are counted in the latency histogram of the process, together
+ * with the ones of @ref switch_to_any_fiber, see @ref account_latency.
  */
-int switch_to_fiber(unsigned fid) {
-    fibered_process_node_t *fibered_process_node;
+int switch_to_fiber(struct file *filp, unsigned fid) {
+    fiber_domain_t *domain;
+    fibered_thread_node_t *fibered_thread_node;
     fiber_node_t *current_fiber_node;
     fiber_node_t *requested_fiber_node;
+    fiber_perf_t *spare_perf = NULL;
+    u64 start = trace_fiber_switch_enabled() ? ktime_get_ns() : 0;
+    cycles_t start_cycles = static_branch_unlikely(&fiber_stats_enabled) ? get_cycles() : 0;
     int ret = 0;
 
+retry:
+    rcu_read_lock();
     // check if process is fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) ret = -ERR_NOT_FIBERED;
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) ret = -ERR_NOT_FIBERED;
     if (ret < 0) goto err_precheck;
     // check if the thread is a fiber
-    current_fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
-    if (current_fiber_node == NULL) ret = -ERR_NOT_FIBERED;
+    fibered_thread_node = check_if_thread_is_fibered(domain, current->pid);
+    if (fibered_thread_node == NULL) ret = -ERR_NOT_FIBERED;
     if (ret < 0) goto err_precheck;
+    if (install_thread_perf(domain, fibered_thread_node, &spare_perf)) {
+        // the counters must be created out of the rcu critical section, since it can sleep
+        rcu_read_unlock();
+        spare_perf = alloc_fiber_perf();
+        goto retry;
+    }
+    current_fiber_node = fibered_thread_node->running_fiber;
     // find a fiber element with id as fid
-    requested_fiber_node = check_if_fiber_exist(fibered_process_node, fid);
+    requested_fiber_node = check_if_fiber_exist(domain, fid);
     if (requested_fiber_node == NULL) ret = -ERR_FIBER_NOT_EXISTS;
     if (ret < 0) goto err_precheck;
 
-    // check if fiber is running
-    if (requested_fiber_node->state == RUNNING) {
+    // claim the fiber, it fails if the fiber is already running
+    if (cmpxchg(&requested_fiber_node->state, IDLE, RUNNING) != IDLE) {
         ret = -ERR_FIBER_ALREADY_RUNNING;
-        requested_fiber_node->failed_activations_count += 1;
+        this_cpu_inc(domain->process->counters->failed_activations);
+        if (static_branch_unlikely(&fiber_stats_enabled) && READ_ONCE(domain->stats_period))
+            atomic_inc(&requested_fiber_node->failed_activations_count);
         goto err_precheck;
     }
+    // the fiber is still in the ready queue, unless a switch_to_any_fiber already took it out
+    spin_lock(&domain->rq_lock);
+    list_del_init(&requested_fiber_node->ready);
+    spin_unlock(&domain->rq_lock);
 
-    // time
-    // -> update the total time, current fiber is always running
-    current_fiber_node->total_time = get_actual_fiber_time(current_fiber_node);
-    // -> update the switch time for the current
-    getnstimeofday(&current_fiber_node->time_last_switch);
-    // -> update the last switch for the fiber-to-come
-    getnstimeofday(&requested_fiber_node->time_last_switch);
-    // params
-    current_fiber_node->state = IDLE;
-    current_fiber_node->run_by = -1;
-    requested_fiber_node->state = RUNNING;
-    requested_fiber_node->run_by = current->pid;
-    requested_fiber_node->success_activations_count += 1;
-    // registers
-    // -> save the current registers
-    memcpy(&current_fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
-    // -> replace pt_regs
-    memcpy(task_pt_regs(current), &requested_fiber_node->regs, sizeof(struct pt_regs));
-    // -> FPU registers
-    // dump the current fpu registers
-    copy_fxregs_to_kernel(&current_fiber_node->fpu_regs);
-    // replace the current with the requested fiber ones
-    copy_kernel_to_fxregs(&requested_fiber_node->fpu_regs.state.fxsave);
+    switch_fiber_context(domain, fibered_thread_node, current_fiber_node, requested_fiber_node);
+    account_latency(domain, start_cycles);
+    if (trace_fiber_switch_enabled() && start != 0)
+        trace_fiber_switch(current_fiber_node->id, fid, ktime_get_ns() - start);
 
 err_precheck:
+    rcu_read_unlock();
+    if (spare_perf != NULL) release_fiber_perf(spare_perf);
+    if (ret < 0) {
+        fiber_count(failed_switches);
+        trace_fiber_switch_failed(fid, ret);
+    }
     return ret;
 }
 
 /**
- * @brief Called when a process ends
+ * @brief Switch to the next idle fiber of the ready queue
  *
  * # Implementation
- * When a process ends we need to clear all the data structures that are associated with it, in
- * particular we need to remove all the @c fiber_node_t in the list of fibers of the process
- * @ref fibered_process_node_t::fibers_list and at the end the given @c fiber_node_t in the global
- * variable of type @ref fibers_list_t::list containing the list of all processes that are fiber
- * enabled. When a process ends, all of these operations need to be done automatically by the kernel
- * module. For this reason this function is used as a handler of a `kprobe` to the function
- * `do_exit`. Since this kind of handler cannot sleep, and we need to synchronize the access to
- * shared memory (essentially for checking if the process is a fiber), only the main threads of
- * every process that calls `do_exit` can enter here. Moreover race conditions that may affect
- * multiple fibered-processes are avoided since we loop on the fibered-processes list with the
- * utility function @ref list_for_each_entry_safe that is safe against removal while looping.
- *
- * @return int 0 if everything OK, otherwise @red ERR_NOT_FIBERED if the process is not a fiber
- */
-int exit_fibered() {
+ * Instead of trying the fibers by their id, and failing on the ones that are already running,
+ * the fiber is taken from fiber_domain::ready_queue, where the fibers are appended when they become
+ * fiber_state::IDLE. The first fiber is taken for @ref FIBER_RQ_FIFO, the last one for
+ * @ref FIBER_RQ_LIFO, see @ref claim_ready_fiber, so the switch succeeds whenever a fiber of the
+ * domain is idle.
+ *
+ * The thread does not know which fiber it is going to run, so its id is written in @p fid before
+ * switching. The write is done with page faults disabled, since it is in a RCU critical section:
+ * if it fails the fiber is put back in the queue, the page is faulted in out of the critical
+ * section, as futexes do, and the switch is retried. EFAULT is returned only if the fault-in
+ * fails, that is when @p fid is not a valid address.
+ *
+ * The switches are counted in the latency histogram of the process like the ones of
+ * @ref switch_to_fiber, see @ref account_latency, so the time spent on the ready queue is in it.
+ *
+ * @param filp the file of the device, the fiber is taken from its @ref fiber_domain
+ * @param fid where the id of the fiber the thread switched to is written, in user space
+ * @return int 0 if everything went OK, otherwise:
+ * - ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
+ * - ERR_NO_IDLE_FIBER if all the fibers of the domain are running
+ * - EFAULT if @p fid cannot be written
+ */
+int switch_to_any_fiber(struct file *filp, long *fid) {
+    fiber_domain_t *domain;
+    fibered_thread_node_t *fibered_thread_node;
+    fiber_node_t *current_fiber_node;
+    fiber_node_t *requested_fiber_node;
+    fiber_perf_t *spare_perf = NULL;
+    u64 start = trace_fiber_switch_enabled() ? ktime_get_ns() : 0;
+    cycles_t start_cycles = static_branch_unlikely(&fiber_stats_enabled) ? get_cycles() : 0;
     int ret = 0;
-    fibered_process_node_t *curr_process = NULL;
-    fiber_node_t *curr_fiber = NULL;
-    fiber_node_t *temp_fiber = NULL;
 
-    spin_lock_irqsave(&fiber_spinlock, irq_flags);
+retry:
+    rcu_read_lock();
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+    fibered_thread_node = check_if_thread_is_fibered(domain, current->pid);
+    if (fibered_thread_node == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+    if (install_thread_perf(domain, fibered_thread_node, &spare_perf)) {
+        rcu_read_unlock();
+        spare_perf = alloc_fiber_perf();
+        goto retry;
+    }
+    requested_fiber_node = claim_ready_fiber(domain);
+    if (requested_fiber_node == NULL) {
+        ret = -ERR_NO_IDLE_FIBER;
+        goto err_precheck;
+    }
 
-    // only the main thread can enter here
-    if (current->tgid != current->pid) ret = -ERR_NOT_FIBERED;
-    if (ret < 0) goto out;
-    // get the process node
-    curr_process = check_if_process_is_fibered(current->tgid);
-    if (curr_process == NULL) ret = -ERR_NOT_FIBERED;
-    if (ret < 0) goto out;
+    pagefault_disable();
+    ret = put_user((long)requested_fiber_node->id, fid);
+    pagefault_enable();
+    if (ret != 0) {
+        long old_fid;
 
-#ifdef DEBUG
-    printk(KERN_DEBUG MODULE_NAME CORE_LOG "Process pid %d request exit_fibered (tid#%d)",
-           current->tgid, current->pid);
-#endif
+        make_fiber_ready(domain, requested_fiber_node);
+        rcu_read_unlock();
+        // the page may just be not resident, so it is faulted in where sleeping is allowed
+        if (get_user(old_fid, fid) == 0 && put_user(old_fid, fid) == 0) goto retry;
+        ret = -EFAULT;
+        goto err_unlocked;
+    }
 
-    if (!list_empty(&curr_process->fibers_list.list)) {
-        list_for_each_entry_safe(curr_fiber, temp_fiber, &curr_process->fibers_list.list, list) {
-            // remove fiber from list
-            list_del(&curr_fiber->list);
-            // free fiber
-            kfree(curr_fiber);
-        }
+    current_fiber_node = fibered_thread_node->running_fiber;
+    switch_fiber_context(domain, fibered_thread_node, current_fiber_node, requested_fiber_node);
+    account_latency(domain, start_cycles);
+    if (trace_fiber_switch_enabled() && start != 0)
+        trace_fiber_switch(current_fiber_node->id, requested_fiber_node->id,
+                           ktime_get_ns() - start);
+
+err_precheck:
+    rcu_read_unlock();
+err_unlocked:
+    if (spare_perf != NULL) release_fiber_perf(spare_perf);
+    // the fiber is not known when the switch fails
+    if (ret < 0) {
+        fiber_count(failed_switches);
+        trace_fiber_switch_failed(UINT_MAX, ret);
     }
+    return ret;
+}
 
-#ifdef USE_HASH_LIST
-    // remove process from hashlist
-    hash_del(&curr_process->hlist);
-#else
-    // remove process from list
-    list_del(&curr_process->list);
-#endif
-    // free process
-    kfree(curr_process);
+/**
+ * @brief Set the policy of the ready queue of a domain
+ *
+ * @param filp the file of the device
+ * @param policy @ref FIBER_RQ_FIFO or @ref FIBER_RQ_LIFO
+ * @return int 0 if everything went OK, otherwise ERR_NOT_FIBERED if the file has no domain of the
+ * process, EINVAL if the policy is unknown
+ */
+int set_ready_queue_policy(struct file *filp, unsigned long policy) {
+    fiber_domain_t *domain;
+    int ret = 0;
 
-#ifdef DEBUG
-    printk(KERN_DEBUG MODULE_NAME CORE_LOG "Process pid %d exited gracefully for ending thread %d",
-           current->tgid, current->pid);
-#endif
-out:
-    spin_unlock_irqrestore(&fiber_spinlock, irq_flags);
+    if (policy != FIBER_RQ_FIFO && policy != FIBER_RQ_LIFO) return -EINVAL;
+    rcu_read_lock();
+    domain = get_fiber_domain(filp);
+    if (domain == NULL)
+        ret = -ERR_NOT_FIBERED;
+    else
+        WRITE_ONCE(domain->rq_policy, policy);
+    rcu_read_unlock();
     return ret;
 }
 
 /**
- * @brief Allocate a new index if the local storage array
+ * @brief Replace the context of the current fiber with the one of the requested fiber
+ *
+ * The requested fiber must have been claimed by the caller, that is it must be
+ * fiber_state::RUNNING and out of fiber_domain::ready_queue. The current fiber is made ready only
+ * after its context has been completely saved. Must be called in a RCU critical section.
+ *
+ * @param domain the domain of the fibers
+ * @param fibered_thread_node the current thread
+ * @param current_fiber_node the fiber that the thread is running
+ * @param requested_fiber_node the fiber that the thread is going to run
+ */
+static void switch_fiber_context(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                                 fiber_node_t *current_fiber_node,
+                                 fiber_node_t *requested_fiber_node) {
+    preempt_disable();
+    // the aggregate counters of the process, always kept
+    fibered_thread_node->switches++;
+    __this_cpu_inc(domain->process->counters->switches);
+    __this_cpu_inc(fiber_counters.switches);
+    // statistics, patched out when no domain collects them
+    if (static_branch_unlikely(&fiber_stats_enabled) && READ_ONCE(domain->stats_period))
+        account_switch(domain, fibered_thread_node, current_fiber_node, requested_fiber_node);
+    // hardware counters, only for the threads of the domains that opted in
+    if (unlikely(!IS_ERR_OR_NULL(fibered_thread_node->perf)) && READ_ONCE(domain->perf_enabled))
+        account_perf(domain, fibered_thread_node->perf, current_fiber_node);
+    // params
+    current_fiber_node->run_by = -1;
+    requested_fiber_node->run_by = current->pid;
+    fibered_thread_node->running_fiber = requested_fiber_node;
+    // registers
+    // -> save the current registers
+    memcpy(&current_fiber_node->regs, task_pt_regs(current), sizeof(struct pt_regs));
+    // -> replace pt_regs
+    memcpy(task_pt_regs(current), &requested_fiber_node->regs, sizeof(struct pt_regs));
+    // -> FPU registers, all the xsave components (AVX, AVX-512...), a fiber created with
+    //    FIBER_FLAG_NOFPU does not use them, so its side is skipped
+    // dump the current fpu registers, XSAVES/XSAVEOPT skip the unmodified components
+    if (!(current_fiber_node->flags & FIBER_FLAG_NOFPU))
+        copy_fpregs_to_fpstate(&current_fiber_node->fpu_regs);
+    // replace the current with the requested fiber ones, XRSTOR(S) puts the components that are
+    // not in the saved state in their init state
+    if (!(requested_fiber_node->flags & FIBER_FLAG_NOFPU))
+        copy_kernel_to_fpregs(&requested_fiber_node->fpu_regs.state);
+    // release the current fiber only when its context is completely saved
+    make_fiber_ready(domain, current_fiber_node);
+    preempt_enable();
+}
+
+/**
+ * @brief Count a switch in the latency histogram of the process
+ *
+ * The cycles are only read while some domain collects statistics, see @ref fiber_stats_enabled, so
+ * with the statistics disabled the switches do not pay for the clock, and only the switches of the
+ * domains with a fiber_domain::stats_period are counted. Unlike the statistics of the fibers, every
+ * switch is counted, not only the sampled ones.
+ *
+ * @param domain the domain of the fibers
+ * @param start_cycles the cycles at the request of the switch, 0 if they were not read
+ */
+static void account_latency(fiber_domain_t *domain, cycles_t start_cycles) {
+    unsigned bucket;
+
+    if (start_cycles == 0 || !READ_ONCE(domain->stats_period)) return;
+    bucket = min_t(unsigned, fls64(get_cycles() - start_cycles), FIBER_LATENCY_BUCKETS - 1);
+    this_cpu_inc(domain->process->counters->latency[bucket]);
+}
+
+/**
+ * @brief Update the statistics of the fibers of a switch
  *
  * # Implementation
- * The function simply check which is the first zero element in the fiber::local_storage::fls_bitmap
- * and if this element is within the maximum size of the local storage array, it sets it to 1 and
- * returns it.
+ * With a fiber_domain::stats_period of N only one switch every N of the thread is sampled: the
+ * activation of the requested fiber is counted and its clocks are started. The clocks of a fiber
+ * that are running are always stopped when the thread switches away from it, so only the time of
+ * the sampled activations is accounted, and the clocks are read only by the switches that start
+ * or stop them. A fiber::time_last_switch of 0 means that the clocks of the fiber are stopped.
  *
- * @return int The available index to be used for storage if everything OK otherwise:
- * - @ref ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
- * - @ref ERR_FLS_FULL if there are no available position to be used for the fiber local storage
+ * @param domain the domain of the fibers
+ * @param fibered_thread_node the current thread
+ * @param current_fiber_node the fiber that the thread is running
+ * @param requested_fiber_node the fiber that the thread is going to run
  */
-int fls_alloc() {
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *current_fiber_node;
-    unsigned long index;
+static void account_switch(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                           fiber_node_t *current_fiber_node, fiber_node_t *requested_fiber_node) {
+    unsigned period = READ_ONCE(domain->stats_period);
+    bool sample = period == 1 || fibered_thread_node->switches % period == 0;
+    u64 now = 0, cpu_now = 0;
 
-    // check if process is fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
-        index = -ERR_NOT_FIBERED;
-        goto err_precheck;
+    // one read of each clock for both the fibers
+    if (sample || current_fiber_node->time_last_switch != 0) {
+        now = ktime_get_ns();
+        cpu_now = get_current_cpu_time();
     }
-    // check if the thread is a fiber
-    current_fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
-    if (current_fiber_node == NULL) {
-        index = -ERR_NOT_FIBERED;
-        goto err_precheck;
+    // -> update the total times of the current
+    if (current_fiber_node->time_last_switch != 0) {
+        current_fiber_node->total_time += now - current_fiber_node->time_last_switch;
+        current_fiber_node->cpu_time += cpu_now - current_fiber_node->cpu_time_last_switch;
+        current_fiber_node->time_last_switch = 0;
     }
+    if (!sample) return;
+    // -> start the clocks of the fiber-to-come
+    requested_fiber_node->time_last_switch = now;
+    requested_fiber_node->cpu_time_last_switch = cpu_now;
+    requested_fiber_node->success_activations_count += 1;
+}
 
-    // find the first zero element in the bitmap
-    index =
-        bitmap_find_next_zero_area(current_fiber_node->local_storage.fls_bitmap, MAX_FLS, 0, 1, 0);
-    if (index > MAX_FLS) {
-        index = -ERR_FLS_FULL;
-        goto err_precheck;
+/**
+ * @brief Set the period of the statistics of the fibers of a domain
+ *
+ * The statistics of the fibers that are running keep going until they are switched, see
+ * @ref account_switch. @ref fiber_stats_enabled counts the domains that collect statistics.
+ *
+ * @param filp the file of the device
+ * @param period 0 for disabling the statistics, 1 for updating them at every switch, N for
+ * sampling one switch every N
+ * @return int 0 if everything went OK, otherwise ERR_NOT_FIBERED if the file has no domain of the
+ * process
+ */
+int set_stats_period(struct file *filp, unsigned long period) {
+    fiber_domain_t *domain;
+    int ret = 0;
+
+    if (period > UINT_MAX) return -EINVAL;
+    // static keys can only be changed where sleeping is allowed
+    mutex_lock(&fibered_processes_mutex);
+    domain = filp->private_data;
+    if (domain == NULL || domain->pid != current->tgid) {
+        ret = -ERR_NOT_FIBERED;
+        goto out;
     }
-    // otherwise the index is available
-    bitmap_set(current_fiber_node->local_storage.fls_bitmap, index, 1);
-err_precheck:
-    return (long)index;
+    if (domain->stats_period == 0 && period != 0) static_branch_inc(&fiber_stats_enabled);
+    if (domain->stats_period != 0 && period == 0) static_branch_dec(&fiber_stats_enabled);
+    WRITE_ONCE(domain->stats_period, period);
+out:
+    mutex_unlock(&fibered_processes_mutex);
+    return ret;
 }
 
 /**
- * @brief Allows for reusing the passed index by clearing it in the bitmap.
+ * @brief Enable or disable the hardware counters of the fibers of a domain
  *
  * # Implementation
+ * The counters cannot be created here for all the threads of the domain, so every thread creates
+ * its own ones at its first switch with the counters enabled, see @ref install_thread_perf. Then
+ * at every switch the events counted by the thread since the previous one are added to the fiber
+ * that it is leaving, see @ref account_perf. What a thread counts while the counters are disabled
+ * is not given to any fiber: fiber_domain::perf_generation tells the threads to take their
+ * readings again.
  *
- * @param index The index of the fls entry to be freed
- * @return int 0 if everything OK, otherwise:
- * - @ref ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
- * - @ref ERR_FLS_INVALID_INDEX if the index passed exceed the maximum size of the local storage or
- * it is associated to an entry that is not allocated
+ * @param filp the file of the device
+ * @param enable 0 for disabling the counters, any other value for enabling them
+ * @return int 0 if everything went OK, otherwise ERR_NOT_FIBERED if the file has no domain of the
+ * process
  */
-int fls_free(long index) {
+int set_perf_counters(struct file *filp, unsigned long enable) {
+    fiber_domain_t *domain;
     int ret = 0;
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *current_fiber_node;
 
-    // check if process is fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
-        ret = -ERR_NOT_FIBERED;
-        goto err_precheck;
-    }
-    // check if the thread is a fiber
-    current_fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
-    if (current_fiber_node == NULL) {
+    mutex_lock(&fibered_processes_mutex);
+    domain = filp->private_data;
+    if (domain == NULL || domain->pid != current->tgid) {
         ret = -ERR_NOT_FIBERED;
-        goto err_precheck;
-    }
-
-    // check if index is valid
-    if (index >= MAX_FLS) {
-        ret = -ERR_FLS_INVALID_INDEX;
-        goto err_precheck;
-    }
-    if (!test_bit(index, current_fiber_node->local_storage.fls_bitmap)) {
-        ret = -ERR_FLS_INVALID_INDEX;
-        goto err_precheck;
+        goto out;
     }
-
-    bitmap_clear(current_fiber_node->local_storage.fls_bitmap, index, 1);
-err_precheck:
+    if (!domain->perf_enabled && enable)
+        WRITE_ONCE(domain->perf_generation, domain->perf_generation + 1);
+    WRITE_ONCE(domain->perf_enabled, enable != 0);
+out:
+    mutex_unlock(&fibered_processes_mutex);
     return ret;
 }
 
 /**
- * @brief Get the value of the fiber local storage at the given index
+ * @brief Give its hardware counters to a thread of a domain that collects them
  *
- * # Implementation
- * The get of a local storage value is done by filling a data structure that is passed by the
- * userspace as @param params. For doing this we need to:
- * 1. Check the process and the thread are fibered
+ * The counters are allocated by the caller out of the RCU critical section, in @p spare_perf,
+ * then this is called again and they are installed. Only the thread itself installs its counters.
+ * If they cannot be created, the error pointer is installed, so that they are not tried again.
+ *
+ * @param domain the domain of the thread
+ * @param fibered_thread_node the current thread
+ * @param spare_perf the counters allocated by the caller, set to NULL if they are installed
+ * @return bool true if the caller has to allocate the counters with @ref alloc_fiber_perf
+ */
+static bool install_thread_perf(fiber_domain_t *domain, fibered_thread_node_t *fibered_thread_node,
+                                fiber_perf_t **spare_perf) {
+    if (likely(!READ_ONCE(domain->perf_enabled)) || fibered_thread_node->perf != NULL) return false;
+    if (*spare_perf == NULL) return true;
+    // the first delta is counted from the creation of the events
+    if (!IS_ERR(*spare_perf)) (*spare_perf)->generation = READ_ONCE(domain->perf_generation);
+    fibered_thread_node->perf = *spare_perf;
+    *spare_perf = NULL;
+    return false;
+}
+
+/**
+ * @brief Read a hardware counter of the current thread
+ *
+ * This is what `perf_event_read_local()` does, that is not exported to modules: the event of the
+ * current thread is active on this cpu, so the pmu can be read directly. Must be called with the
+ * interrupts disabled.
+ *
+ * @param event an event bound to the current thread
+ * @return u64 the value of the counter
+ */
+static inline u64 read_perf_event(struct perf_event *event) {
+    if (event->state == PERF_EVENT_STATE_ACTIVE && event->oncpu == smp_processor_id())
+        event->pmu->read(event);
+    return local64_read(&event->count);
+}
+
+/**
+ * @brief Add to the current fiber the hardware events counted by the thread since the last switch
+ *
+ * @param domain the domain of the fibers
+ * @param perf the counters of the current thread
+ * @param current_fiber_node the fiber that the thread is leaving
+ */
+static void account_perf(fiber_domain_t *domain, fiber_perf_t *perf,
+                         fiber_node_t *current_fiber_node) {
+    unsigned generation = READ_ONCE(domain->perf_generation);
+    unsigned long flags;
+    u64 value;
+    int i;
+
+    local_irq_save(flags);
+    for (i = 0; i < FIBER_PERF_EVENTS; i++) {
+        value = read_perf_event(perf->events[i]);
+        // the readings taken before the counters were disabled are stale
+        if (perf->generation == generation)
+            current_fiber_node->perf_counts[i] += value - perf->last[i];
+        perf->last[i] = value;
+    }
+    local_irq_restore(flags);
+    perf->generation = generation;
+}
+
+/**
+ * @brief Create the hardware counters of the current thread
+ *
+ * @return fiber_perf_t* the counters, or an error pointer if the cpu or the kernel does not have
+ * them
+ */
+static fiber_perf_t *alloc_fiber_perf() {
+    // clang-format off
+    static const u64 configs[FIBER_PERF_EVENTS] = {
+        [FIBER_PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [FIBER_PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+        [FIBER_PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES
+    };
+    // clang-format on
+    struct perf_event_attr attr = {0};
+    struct perf_event *event;
+    fiber_perf_t *perf;
+    int i;
+
+    perf = kzalloc(sizeof(fiber_perf_t), GFP_KERNEL);
+    if (perf == NULL) return ERR_PTR(-ENOMEM);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(struct perf_event_attr);
+    attr.pinned = 1;
+    attr.exclude_hv = 1;
+    for (i = 0; i < FIBER_PERF_EVENTS; i++) {
+        attr.config = configs[i];
+        event = perf_event_create_kernel_counter(&attr, -1, current, NULL, NULL);
+        if (IS_ERR(event)) {
+            printk(KERN_ALERT MODULE_NAME CORE_LOG "alloc_fiber_perf() cannot create event %d: %ld",
+                   i, PTR_ERR(event));
+            release_fiber_perf(perf);
+            return ERR_CAST(event);
+        }
+        perf->events[i] = event;
+    }
+    return perf;
+}
+
+/**
+ * @brief Release the hardware counters of a thread, it can sleep
+ *
+ * @param perf the counters, an error pointer is ignored
+ */
+static void release_fiber_perf(fiber_perf_t *perf) {
+    int i;
+
+    if (IS_ERR(perf)) return;
+    for (i = 0; i < FIBER_PERF_EVENTS; i++)
+        if (perf->events[i] != NULL) perf_event_release_kernel(perf->events[i]);
+    kfree(perf);
+}
+
+/**
+ * @brief The work of @ref release_fiber_perf, for the counters of the freed domains
+ *
+ * @param work the fiber_perf::work field of the counters
+ */
+static void release_fiber_perf_work(struct work_struct *work) {
+    release_fiber_perf(container_of(work, fiber_perf_t, work));
+}
+
+/**
+ * @brief Move a fiber to fiber_state::IDLE and append it to fiber_domain::ready_queue
+ *
+ * Both are done under fiber_domain::rq_lock: a fiber that is claimed by its id, see
+ * @ref switch_to_fiber, is removed from the queue under the same lock, so the claim cannot be
+ * seen before the fiber is queued and the fiber cannot be queued twice.
+ *
+ * @param domain the domain of the fiber
+ * @param fiber_node the fiber, whose context has been completely saved
+ */
+static void make_fiber_ready(fiber_domain_t *domain, fiber_node_t *fiber_node) {
+    spin_lock(&domain->rq_lock);
+    smp_store_release(&fiber_node->state, IDLE);
+    list_add_tail(&fiber_node->ready, &domain->ready_queue);
+    spin_unlock(&domain->rq_lock);
+}
+
+/**
+ * @brief Claim the next fiber of fiber_domain::ready_queue according to fiber_domain::rq_policy
+ *
+ * A fiber of the queue may have just been claimed by its id and not yet removed from the queue, so
+ * every fiber is claimed as in @ref switch_to_fiber, the ones that are already running are only
+ * removed.
+ *
+ * @param domain the domain of the fibers
+ * @return fiber_node_t* the fiber, now fiber_state::RUNNING, or NULL if no fiber is idle
+ */
+static fiber_node_t *claim_ready_fiber(fiber_domain_t *domain) {
+    fiber_node_t *fiber_node = NULL;
+
+    spin_lock(&domain->rq_lock);
+    while (!list_empty(&domain->ready_queue)) {
+        if (READ_ONCE(domain->rq_policy) == FIBER_RQ_LIFO)
+            fiber_node = list_last_entry(&domain->ready_queue, fiber_node_t, ready);
+        else
+            fiber_node = list_first_entry(&domain->ready_queue, fiber_node_t, ready);
+        list_del_init(&fiber_node->ready);
+        if (cmpxchg(&fiber_node->state, IDLE, RUNNING) == IDLE) break;
+        fiber_node = NULL;
+    }
+    spin_unlock(&domain->rq_lock);
+    return fiber_node;
+}
+
+/**
+ * @brief Called when a process asks to leave the fiber environment
+ *
+ * # Implementation
+ * Only the process that owns the @ref fiber_domain of @p filp can request the exit, then the work
+ * is done by @ref unbind_fiber_domain. The file can be used again for a new domain, so the pages
+ * of the old one are unmapped from the mappings of the device, they are faulted again from the new
+ * domain.
+ *
+ * @param filp the file of the device opened by the process
+ * @return int 0 if everything OK, otherwise @ref ERR_NOT_FIBERED if the process is not a fiber,
+ * `EBADF` if the file belongs to another process
+ */
+int exit_fibered(struct file *filp) {
+    fiber_domain_t *domain;
+    int ret = 0;
+
+    mutex_lock(&fibered_processes_mutex);
+    domain = filp->private_data;
+    if (domain == NULL)
+        ret = -ERR_NOT_FIBERED;
+    else if (domain->pid != current->tgid)
+        ret = -EBADF;
+    if (ret == 0) unbind_fiber_domain(filp);
+    mutex_unlock(&fibered_processes_mutex);
+    // the mappings of the file must not show the local storage of the old domain anymore, the
+    // mapping of the file is its own, see device_open, so the other files are not touched
+    if (ret == 0) unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+    return ret;
+}
+
+/**
+ * @brief Called when the last reference to a file of the device is dropped
+ *
+ * # Implementation
+ * A process keeps its file of the device open until it ends, so the @ref fiber_domain of @p filp,
+ * if any, is released here. In this way the teardown only costs something to the processes that
+ * used the module, instead of hooking the exit of every thread of the system.
+ *
+ * @param filp the file of the device that is being released
+ */
+void release_fibered(struct file *filp) {
+    mutex_lock(&fibered_processes_mutex);
+    if (filp->private_data != NULL) unbind_fiber_domain(filp);
+    mutex_unlock(&fibered_processes_mutex);
+}
+
+/**
+ * @brief Create the fiber domain of a file of the device
+ *
+ * # Implementation
+ * The new @ref fiber_domain is appended to fibered_process::domains of the process of the calling
+ * thread, that becomes *fiber-enabled* if it is the first domain, which means that a
+ * @ref fibered_process is inserted in @ref fibered_processes_list. The domain takes the first
+ * free id in fibered_process::domains_ids. Must be called holding @ref fibered_processes_mutex.
+ *
+ * A process is released with its last file of the device, that a child can keep open after the
+ * process ended, so the pid can be reused while the old @ref fibered_process is still in the
+ * table. The process found by pid is the one of the caller only if fibered_process::start_time is
+ * the one of its main thread, otherwise the old one is removed from the table and from /proc.
+ *
+ * @param filp the file of the device, it must have no domain
+ * @return int 0 if everything OK, otherwise `ENOMEM` or `EMFILE` if the process already has
+ * @ref FIBER_MAX_DOMAINS domains
+ */
+static int bind_fiber_domain(struct file *filp) {
+    fibered_process_node_t *fibered_process_node;
+    fibered_process_node_t *new_process_node = NULL;
+    fiber_domain_t *domain;
+    unsigned long domain_id;
+    int ret;
+
+    domain = kmalloc(sizeof(fiber_domain_t), GFP_KERNEL);
+    if (domain == NULL) return -ENOMEM;
+    domain->fls_bitmap = (unsigned long *)get_zeroed_page(GFP_KERNEL);
+    if (domain->fls_bitmap == NULL) {
+        kfree(domain);
+        return -ENOMEM;
+    }
+
+    fibered_process_node = check_if_process_is_fibered(current->tgid);
+    if (fibered_process_node != NULL &&
+        fibered_process_node->start_time != current->group_leader->start_time) {
+        // an ended process with the same pid, kept by the files that a child inherited: it leaves
+        // the table and /proc to this one, it is freed with its last domain
+        rhashtable_remove_fast(&fibered_processes_list.hash_table, &fibered_process_node->hnode,
+                               fibered_processes_params);
+        proc_unregister_process(fibered_process_node);
+        fibered_process_node = NULL;
+    }
+    if (fibered_process_node == NULL) {
+        // process has never created a fiber
+        new_process_node = kmalloc(sizeof(fibered_process_node_t), GFP_KERNEL);
+        if (new_process_node == NULL) {
+            ret = -ENOMEM;
+            goto err;
+        }
+        new_process_node->pid = current->tgid;
+        new_process_node->start_time = current->group_leader->start_time;
+        new_process_node->counters = alloc_percpu(fibered_process_counters_t);
+        if (new_process_node->counters == NULL) {
+            ret = -ENOMEM;
+            goto err;
+        }
+        INIT_LIST_HEAD(&new_process_node->domains);
+        bitmap_zero(new_process_node->domains_ids, FIBER_MAX_DOMAINS);
+        ret = rhashtable_insert_fast(&fibered_processes_list.hash_table, &new_process_node->hnode,
+                                     fibered_processes_params);
+        if (ret < 0) goto err;
+        fibered_process_node = new_process_node;
+        proc_register_process(fibered_process_node);
+    }
+    // a new process always has a free id
+    domain_id = find_first_zero_bit(fibered_process_node->domains_ids, FIBER_MAX_DOMAINS);
+    if (domain_id >= FIBER_MAX_DOMAINS) {
+        ret = -EMFILE;
+        goto err;
+    }
+    set_bit(domain_id, fibered_process_node->domains_ids);
+
+    domain->id = domain_id;
+    domain->pid = current->tgid;
+    domain->process = fibered_process_node;
+    spin_lock_init(&domain->lock);
+    INIT_LIST_HEAD(&domain->fibers_list.list);
+    idr_init(&domain->fibers_list.fibers_idr);
+    idr_init(&domain->fibers_list.generations);
+    domain->fibers_list.fibers_count = 0;
+    hash_init(domain->threads);
+    spin_lock_init(&domain->rq_lock);
+    INIT_LIST_HEAD(&domain->ready_queue);
+    domain->threads_count = 0;
+    domain->rq_policy = FIBER_RQ_FIFO;
+    domain->stats_period = READ_ONCE(stats_period);
+    if (domain->stats_period != 0) static_branch_inc(&fiber_stats_enabled);
+    domain->perf_enabled = false;
+    domain->perf_generation = 0;
+    list_add_tail_rcu(&domain->list, &fibered_process_node->domains);
+    rcu_assign_pointer(filp->private_data, domain);
+    return 0;
+
+err:
+    if (new_process_node != NULL) free_percpu(new_process_node->counters);
+    kfree(new_process_node);
+    free_page((unsigned long)domain->fls_bitmap);
+    kfree(domain);
+    return ret;
+}
+
+/**
+ * @brief Release the fiber domain of a file of the device
+ *
+ * # Implementation
+ * When a domain is released we need to clear all the data structures that are associated with it,
+ * in particular we need to remove all the @c fiber_node_t in fiber_domain::fibers_list and the
+ * threads in fiber_domain::threads. The domain is unlinked from the file and from its process,
+ * that is removed from @ref fibered_processes_list if this was its last domain, but other threads
+ * of the process could still be using them, since every lookup is done under RCU: for this reason
+ * the actual free is deferred with @c call_rcu to @ref destroy_fiber_domain. Must be called
+ * holding @ref fibered_processes_mutex.
+ *
+ * @param filp the file of the device the domain belongs to
+ */
+static void unbind_fiber_domain(struct file *filp) {
+    fiber_domain_t *domain = filp->private_data;
+    fibered_process_node_t *fibered_process_node = domain->process;
+
+#ifdef DEBUG
+    printk(KERN_DEBUG MODULE_NAME CORE_LOG "Process pid %d exit_fibered domain %u (tid#%d)",
+           domain->pid, domain->id, current->pid);
+#endif
+
+    trace_fiber_exit(domain->pid, domain->id, domain->fibers_list.fibers_count);
+    fiber_count(exits);
+    rcu_assign_pointer(filp->private_data, NULL);
+    if (domain->stats_period != 0) static_branch_dec(&fiber_stats_enabled);
+    list_del_rcu(&domain->list);
+    clear_bit(domain->id, fibered_process_node->domains_ids);
+    if (list_empty(&fibered_process_node->domains)) {
+        // not in the table anymore if a later process with the same pid replaced it
+        rhashtable_remove_fast(&fibered_processes_list.hash_table, &fibered_process_node->hnode,
+                               fibered_processes_params);
+        proc_unregister_process(fibered_process_node);
+        call_rcu(&fibered_process_node->rcu, destroy_fibered_process);
+    }
+    // free the domain when no reader can be using it anymore
+    call_rcu(&domain->rcu, destroy_fiber_domain);
+}
+
+/**
+ * @brief Free a fiber domain with all its fibers and threads
+ *
+ * This is the @c call_rcu callback of @ref unbind_fiber_domain, so it runs when the domain has
+ * been unlinked and all the readers that could have found it are done.
+ *
+ * @param rcu the @ref fiber_domain::rcu field of the domain to free
+ */
+static void destroy_fiber_domain(struct rcu_head *rcu) {
+    fiber_domain_t *domain = container_of(rcu, fiber_domain_t, rcu);
+    fibered_thread_node_t *curr_thread = NULL;
+    fiber_node_t *curr_fiber = NULL;
+    fiber_node_t *temp_fiber = NULL;
+    struct hlist_node *temp_thread = NULL;
+    u8 *generations;
+    unsigned bkt;
+    int i;
+
+    list_for_each_entry_safe(curr_fiber, temp_fiber, &domain->fibers_list.list, list) {
+        // remove fiber from list
+        list_del(&curr_fiber->list);
+        release_fiber_node(curr_fiber);
+    }
+    idr_destroy(&domain->fibers_list.fibers_idr);
+    idr_for_each_entry(&domain->fibers_list.generations, generations, i)
+        free_page((unsigned long)generations);
+    idr_destroy(&domain->fibers_list.generations);
+    hash_for_each_safe(domain->threads, bkt, temp_thread, curr_thread, hlist) {
+        // remove thread from hashlist
+        hash_del(&curr_thread->hlist);
+        // the counters cannot be released in a rcu callback, since it can sleep
+        if (!IS_ERR_OR_NULL(curr_thread->perf)) {
+            INIT_WORK(&curr_thread->perf->work, release_fiber_perf_work);
+            schedule_work(&curr_thread->perf->work);
+        }
+        // free thread
+        kfree(curr_thread);
+    }
+#ifdef DEBUG
+    printk(KERN_DEBUG MODULE_NAME CORE_LOG "Process pid %d domain %u exited gracefully",
+           domain->pid, domain->id);
+#endif
+    // free domain, the bitmap is kept by the mappings like the chunks
+    free_page((unsigned long)domain->fls_bitmap);
+    kfree(domain);
+}
+
+/**
+ * @brief Free a fibered process, the @c call_rcu callback of @ref unbind_fiber_domain for the
+ * last domain of the process
+ *
+ * @param rcu the @ref fibered_process::rcu field of the process to free
+ */
+static void destroy_fibered_process(struct rcu_head *rcu) {
+    fibered_process_node_t *fibered_process_node = container_of(rcu, fibered_process_node_t, rcu);
+
+    free_percpu(fibered_process_node->counters);
+    kfree(fibered_process_node);
+}
+
+/**
+ * @brief Allocate a new index if the local storage array
+ *
+ * # Implementation
+ * The indexes are shared by all the fibers of the domain, so the function checks which is the first
+ * zero element in the fiber_domain::fls_bitmap under fiber_domain::lock and if this element is
+ * within the maximum size of the local storage array, it sets it to 1 and returns it. No memory is
+ * allocated for the values here, see @ref fls_set.
+ *
+ * @return int The available index to be used for storage if everything OK otherwise:
+ * - @ref ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
+ * - @ref ERR_FLS_FULL if there are no available position to be used for the fiber local storage
+ */
+int fls_alloc(struct file *filp) {
+    fiber_domain_t *domain;
+    unsigned long index;
+    long ret;
+
+    rcu_read_lock();
+    // check if process is fiber enabled
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+    // check if the thread is a fiber
+    if (check_if_this_thread_is_fiber(domain) == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+
+    spin_lock(&domain->lock);
+    // find the first zero element in the bitmap
+    index = find_first_zero_bit(domain->fls_bitmap, MAX_FLS);
+    if (index >= MAX_FLS) {
+        ret = -ERR_FLS_FULL;
+    } else {
+        // otherwise the index is available
+        set_bit(index, domain->fls_bitmap);
+        ret = index;
+        trace_fiber_fls_alloc(index, 0);
+        fiber_count(fls_ops);
+    }
+    spin_unlock(&domain->lock);
+err_precheck:
+    rcu_read_unlock();
+    return ret;
+}
+
+/**
+ * @brief Allows for reusing the passed index by clearing it in the bitmap.
+ *
+ * # Implementation
+ * The value of the index is reset in all the fibers of the domain that have its chunk, so that the
+ * next @ref fls_alloc that returns it finds it zeroed, as a newly allocated one.
+ *
+ * @param index The index of the fls entry to be freed
+ * @return int 0 if everything OK, otherwise:
+ * - @ref ERR_NOT_FIBERED if the process is not fiber-enabled or the thread is not a fiber
+ * - @ref ERR_FLS_INVALID_INDEX if the index passed exceed the maximum size of the local storage or
+ * it is associated to an entry that is not allocated
+ */
+int fls_free(struct file *filp, long index) {
+    int ret = 0;
+    fiber_domain_t *domain;
+    fiber_node_t *fiber_cursor;
+    struct page *chunk;
+
+    rcu_read_lock();
+    // check if process is fiber enabled
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+    // check if the thread is a fiber
+    if (check_if_this_thread_is_fiber(domain) == NULL) {
+        ret = -ERR_NOT_FIBERED;
+        goto err_precheck;
+    }
+
+    // check if index is valid
+    if (index < 0 || index >= MAX_FLS) {
+        ret = -ERR_FLS_INVALID_INDEX;
+        goto err_precheck;
+    }
+
+    spin_lock(&domain->lock);
+    if (!test_and_clear_bit(index, domain->fls_bitmap)) {
+        ret = -ERR_FLS_INVALID_INDEX;
+    } else {
+        list_for_each_entry(fiber_cursor, &domain->fibers_list.list, list) {
+            chunk = READ_ONCE(fiber_cursor->local_storage.chunks[index / FLS_CHUNK_CELLS]);
+            if (chunk != NULL) ((long *)page_address(chunk))[index % FLS_CHUNK_CELLS] = 0;
+        }
+        trace_fiber_fls_free(index, 0);
+        fiber_count(fls_ops);
+    }
+    spin_unlock(&domain->lock);
+err_precheck:
+    rcu_read_unlock();
+    return ret;
+}
+
+/**
+ * @brief Get the value of the fiber local storage at the given index
+ *
+ * # Implementation
+ * The get of a local storage value is done by filling a data structure that is passed by the
+ * userspace as @param params. For doing this we need to:
+ * 1. Check the process and the thread are fibered
  * 2. Copy the passed data structure into kernel memory by using `copy_from_user`
  * 3. Check if the position is valid
- * 4. Get the value and update the local copy of the data structure
+ * 4. Get the value and update the local copy of the data structure, the value is 0 if its chunk
+ * has never been allocated
  * 5. Copy the local structure to the userspace with the function `copy_to_user`
  *
  * @param params @ref fls_params_t that need to have as @ref fls_params_t::idx the requested
@@ -527,51 +1513,75 @@ err_precheck:
  * - @ref ERR_FLS_INVALID_INDEX if the index passed exceed the maximum size of the local storage or
  * it is associated to an entry that is not allocated
  */
-long fls_get(fls_params_t *params) {
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *current_fiber_node;
+long fls_get(struct file *filp, fls_params_t *params) {
     fls_params_t k_params;
-    int ret;
+    long ret;
+
+    ret = copy_from_user((void *)&k_params, (void *)params, sizeof(fls_params_t));
+    if (ret != 0) {
+        printk(KERN_ALERT MODULE_NAME CORE_LOG "fls_get() copy_from_user didn't copy %ld bytes",
+               ret);
+        return -EFAULT;
+    }
+    ret = fls_get_kern(filp, &k_params);
+    if (ret < 0) return ret;
 
+    // copy to user only out of the rcu critical section, since it can sleep
+    ret = copy_to_user((void *)params, (void *)&k_params, sizeof(fls_params_t));
+    if (ret != 0) {
+        printk(KERN_ALERT MODULE_NAME CORE_LOG "fls_get() copy_to_user didn't copy %ld bytes", ret);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the value of the local storage at given index, with params in kernel memory
+ *
+ * The implementation of @ref fls_get, shared with @ref run_batch.
+ *
+ * @param filp the file of the device
+ * @param k_params the index, fls_params_t::value is filled with the value
+ * @return long 0 if everything is OK, otherwise an error as @ref fls_get
+ */
+static long fls_get_kern(struct file *filp, fls_params_t *k_params) {
+    fiber_domain_t *domain;
+    fiber_node_t *current_fiber_node;
+    struct page *chunk;
+    long ret;
+
+    rcu_read_lock();
     // check if process is fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
     //  check if the thread is a fiber
-    current_fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
+    current_fiber_node = check_if_this_thread_is_fiber(domain);
     if (current_fiber_node == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
 
-    ret = copy_from_user((void *)&k_params, (void *)params, sizeof(fls_params_t));
-    if (ret != 0) {
-        printk(KERN_ALERT MODULE_NAME CORE_LOG "fls_get() copy_from_user didn't copy %d bytes",
-               ret);
-        ret = -EFAULT;
-        goto err_precheck;
-    }
     // check if index is valid
-    if (k_params.idx >= MAX_FLS) {
+    if (k_params->idx < 0 || k_params->idx >= MAX_FLS) {
         ret = -ERR_FLS_INVALID_INDEX;
         goto err_precheck;
     }
-    if (!test_bit(k_params.idx, current_fiber_node->local_storage.fls_bitmap)) {
+    if (!test_bit(k_params->idx, domain->fls_bitmap)) {
         ret = -ERR_FLS_INVALID_INDEX;
         goto err_precheck;
     }
 
-    k_params.value = current_fiber_node->local_storage.fls[k_params.idx];
-    ret = copy_to_user((void *)params, (void *)&k_params, sizeof(fls_params_t));
-    if (ret != 0) {
-        printk(KERN_ALERT MODULE_NAME CORE_LOG "fls_get() copy_to_user didn't copy %d bytes", ret);
-        ret = -EFAULT;
-        goto err_precheck;
-    }
+    chunk = READ_ONCE(current_fiber_node->local_storage.chunks[k_params->idx / FLS_CHUNK_CELLS]);
+    k_params->value =
+        chunk == NULL ? 0 : ((long *)page_address(chunk))[k_params->idx % FLS_CHUNK_CELLS];
+    trace_fiber_fls_get(k_params->idx, k_params->value);
+    fiber_count(fls_ops);
     ret = 0;
 err_precheck:
+    rcu_read_unlock();
     return ret;
 }
 
@@ -582,7 +1592,8 @@ err_precheck:
  * When setting a value in the local storage we need to read a data structure passed from the user
  * space, so we need to:
  * 1. Copy the data structure in the kernel memory with `copy_from_user`
- * 2. Read the data and set the value in the local storage array
+ * 2. Read the data and set the value in the local storage array, the chunk of the value is
+ * allocated here if it is the first one that is set, see @ref get_fls_chunk
  *
  * @param params
  * @return int  long 0 if everything is OK, otherwise:
@@ -591,9 +1602,7 @@ err_precheck:
  * - @ref ERR_FLS_INVALID_INDEX if the index passed exceed the maximum size of the local storage or
  * it is associated to an entry that is not allocated
  */
-int fls_set(fls_params_t *params) {
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *current_fiber_node;
+int fls_set(struct file *filp, fls_params_t *params) {
     fls_params_t params_kern;
     int ret;
 
@@ -601,38 +1610,414 @@ int fls_set(fls_params_t *params) {
     if (ret != 0) {
         printk(KERN_ALERT MODULE_NAME CORE_LOG "fls_set() copy_from_user didn't copy %d bytes",
                ret);
-        ret = -EFAULT;
-        goto err_precheck;
+        return -EFAULT;
     }
+    return fls_set_kern(filp, &params_kern);
+}
+
+/**
+ * @brief Set the value of the local storage at given index, with params in kernel memory
+ *
+ * The implementation of @ref fls_set, shared with @ref run_batch.
+ *
+ * @param filp the file of the device
+ * @param params_kern the index and the value
+ * @return int 0 if everything is OK, otherwise an error as @ref fls_set
+ */
+static int fls_set_kern(struct file *filp, fls_params_t *params_kern) {
+    fiber_domain_t *domain;
+    fiber_node_t *current_fiber_node;
+    struct page *chunk, *spare_chunk = NULL;
+    int ret;
+
+retry:
+    rcu_read_lock();
     // check if process is fiber enabled
-    fibered_process_node = check_if_process_is_fibered(current->tgid);
-    if (fibered_process_node == NULL) {
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
     // check if the thread is a fiber
-    current_fiber_node = check_if_this_thread_is_fiber(fibered_process_node);
+    current_fiber_node = check_if_this_thread_is_fiber(domain);
     if (current_fiber_node == NULL) {
         ret = -ERR_NOT_FIBERED;
         goto err_precheck;
     }
 
     // check if index is valid
-    if (params_kern.idx >= MAX_FLS) {
+    if (params_kern->idx < 0 || params_kern->idx >= MAX_FLS) {
         ret = -ERR_FLS_INVALID_INDEX;
         goto err_precheck;
     }
-    // index must be one that has been previously given to the fiber
-    if (!test_bit(params_kern.idx, current_fiber_node->local_storage.fls_bitmap)) {
+    // index must be one that has been previously allocated in the domain
+    if (!test_bit(params_kern->idx, domain->fls_bitmap)) {
         ret = -ERR_FLS_INVALID_INDEX;
         goto err_precheck;
     }
-    current_fiber_node->local_storage.fls[params_kern.idx] = params_kern.value;
+    chunk = get_fls_chunk(current_fiber_node, params_kern->idx / FLS_CHUNK_CELLS, &spare_chunk);
+    if (chunk == NULL) {
+        // the chunk must be allocated out of the rcu critical section, since it can sleep
+        rcu_read_unlock();
+        spare_chunk = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (spare_chunk == NULL) return -ENOMEM;
+        goto retry;
+    }
+    ((long *)page_address(chunk))[params_kern->idx % FLS_CHUNK_CELLS] = params_kern->value;
+    trace_fiber_fls_set(params_kern->idx, params_kern->value);
+    fiber_count(fls_ops);
     ret = 0;
 err_precheck:
+    rcu_read_unlock();
+    if (spare_chunk != NULL) __free_page(spare_chunk);
     return ret;
 }
 
+/**
+ * @brief Get the page of the fiber local storage that is mapped at the given offset of the device
+ *
+ * # Implementation
+ * The mapping of the device exposes the local storage of the @ref fiber_domain of @p filp: the
+ * first page is fiber_domain::fls_bitmap, then the values of the fiber with index i in the domain
+ * take @ref FLS_CHUNKS pages from the offset @ref FLS_MAP_BITMAP_SIZE + i * @ref FLS_MAP_SIZE.
+ * The chunks of the values are allocated here if they are not yet, since the library reads and
+ * writes them directly. The page is returned with a reference taken for the mapping, so it stays
+ * valid even if the fiber is freed while it is still mapped.
+ *
+ * @param filp the file of the device that is mapped
+ * @param pgoff the offset in pages in the mapping
+ * @return struct page* the page or NULL if there is no fiber at that offset or there is no memory
+ */
+struct page *fls_get_page(struct file *filp, unsigned long pgoff) {
+    fiber_domain_t *domain;
+    fiber_node_t *fiber_node;
+    struct page *page = NULL, *spare_chunk = NULL;
+    unsigned long fiber_index;
+
+    fiber_index = (pgoff - FLS_MAP_BITMAP_SIZE / PAGE_SIZE) / FLS_CHUNKS;
+    if (pgoff >= FLS_MAP_BITMAP_SIZE / PAGE_SIZE && fiber_index >= FIBER_MAX_FIBERS) return NULL;
+
+retry:
+    rcu_read_lock();
+    domain = get_fiber_domain(filp);
+    if (domain == NULL) goto out;
+    if (pgoff < FLS_MAP_BITMAP_SIZE / PAGE_SIZE) {
+        page = virt_to_page(domain->fls_bitmap);
+    } else {
+        fiber_node = idr_find(&domain->fibers_list.fibers_idr, fiber_index);
+        if (fiber_node == NULL) goto out;
+        page = get_fls_chunk(fiber_node, (pgoff - FLS_MAP_BITMAP_SIZE / PAGE_SIZE) % FLS_CHUNKS,
+                             &spare_chunk);
+        if (page == NULL) {
+            // the chunk must be allocated out of the rcu critical section, since it can sleep
+            rcu_read_unlock();
+            spare_chunk = alloc_page(GFP_KERNEL | __GFP_ZERO);
+            if (spare_chunk == NULL) return NULL;
+            goto retry;
+        }
+    }
+    get_page(page);
+out:
+    rcu_read_unlock();
+    if (spare_chunk != NULL) __free_page(spare_chunk);
+    return page;
+}
+
+/*
+ * Batches
+ */
+
+/**
+ * @brief Run a batch of operations in a single call of the device
+ *
+ * # Implementation
+ * The operations are copied from user space in groups of @ref FIBER_BATCH_CHUNK in a kernel
+ * buffer, then every operation is executed with the same function that serves its single ioctl,
+ * so the checks and the results are the same; only the cost of entering the kernel is paid once.
+ * The result of every operation executed is written in fiber_batch_op::ret, and the value read by
+ * a @ref FIBER_BATCH_FLS_GET in fiber_batch_op::fls, then the group is copied back to user space.
+ *
+ * The batch stops at the first operation that fails, the operations that follow it are not
+ * executed and their fiber_batch_op::ret is not touched. A @ref FIBER_BATCH_SWITCH replaces the
+ * registers of the thread, so it must be the last operation of the batch, otherwise it fails with
+ * `EINVAL` without switching. On a successful switch the value returned is seen by the fiber that
+ * the thread switched to, that is why the batch returns 0 like @ref switch_to_fiber.
+ *
+ * @param filp the file of the device
+ * @param params the array of operations in user space
+ * @return int 0 if all the operations succeeded, otherwise the error of the first one that failed,
+ * or `EFAULT` if the operations cannot be copied, `EINVAL` if an operation is unknown
+ */
+int run_batch(struct file *filp, fiber_batch_params_t *params) {
+    fiber_batch_params_t params_kern;
+    fiber_batch_op_t *ops, *op;
+    unsigned long done, n, i;
+    int ret = 0;
+
+    if (copy_from_user(&params_kern, params, sizeof(fiber_batch_params_t)) != 0) return -EFAULT;
+    if (params_kern.count == 0) return 0;
+
+    ops = kmalloc_array(FIBER_BATCH_CHUNK, sizeof(fiber_batch_op_t), GFP_KERNEL);
+    if (ops == NULL) return -ENOMEM;
+
+    for (done = 0; done < params_kern.count && ret >= 0; done += n) {
+        n = min_t(unsigned long, params_kern.count - done, FIBER_BATCH_CHUNK);
+        if (copy_from_user(ops, (fiber_batch_op_t *)params_kern.ops + done,
+                           n * sizeof(fiber_batch_op_t)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+        for (i = 0; i < n && ret >= 0; i++) {
+            op = &ops[i];
+            switch (op->op) {
+            case FIBER_BATCH_CREATE:
+                op->ret = create_fiber_kern(filp, &op->create);
+                break;
+            case FIBER_BATCH_FLS_GET:
+                op->ret = fls_get_kern(filp, &op->fls);
+                break;
+            case FIBER_BATCH_FLS_SET:
+                op->ret = fls_set_kern(filp, &op->fls);
+                break;
+            case FIBER_BATCH_SWITCH:
+                op->ret = done + i + 1 == params_kern.count ? switch_to_fiber(filp, op->fid)
+                                                              : -EINVAL;
+                break;
+            default:
+                op->ret = -EINVAL;
+                break;
+            }
+            if (op->ret < 0) ret = op->ret;
+        }
+        // write back only the operations that have been executed
+        if (copy_to_user((fiber_batch_op_t *)params_kern.ops + done, ops,
+                         i * sizeof(fiber_batch_op_t)) != 0)
+            ret = -EFAULT;
+    }
+
+    kfree(ops);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief Copy the statistics of all the fibers of a process to user space in a single call
+ *
+ * # Implementation
+ * The fibers are walked in the order of their id with @ref get_next_fiber_in_process, starting
+ * from fiber_snapshot_params::next. The records are filled in a kernel buffer of
+ * @ref FIBER_SNAPSHOT_CHUNK records under RCU, then copied to user space out of the critical
+ * section, since the copy can sleep, and the walk goes on from the id of the last fiber copied.
+ * So the process is never locked and the fibers created or freed during the snapshot may or may
+ * not be in it. When the array is full, fiber_snapshot_params::next is set to the id where a new
+ * snapshot has to start for the remaining fibers. The data is the same as the world readable
+ * files of /proc/<pid>/fibers, so any process can be snapshotted.
+ *
+ * @param params the process and the array of records in user space
+ * @return int the number of records copied, otherwise ERR_NOT_FIBERED if the process is not
+ * fiber-enabled, `EFAULT` if the params or the records cannot be copied
+ */
+int snapshot_fibers(fiber_snapshot_params_t *params) {
+    fiber_snapshot_params_t params_kern;
+    fibered_process_node_t *fibered_process_node;
+    fiber_node_t *fiber_node = NULL;
+    fiber_snapshot_t *records, *record;
+    unsigned long copied = 0, n;
+    pid_t pid;
+    int ret = 0;
+
+    if (copy_from_user(&params_kern, params, sizeof(fiber_snapshot_params_t)) != 0) return -EFAULT;
+    pid = params_kern.pid == 0 ? current->tgid : params_kern.pid;
+    // no fiber has a higher slot
+    if (params_kern.next >= FIBER_MAX_SLOTS) params_kern.next = FIBER_SNAPSHOT_END;
+    records = kmalloc_array(FIBER_SNAPSHOT_CHUNK, sizeof(fiber_snapshot_t), GFP_KERNEL);
+    if (records == NULL) return -ENOMEM;
+
+    while (copied < params_kern.count && params_kern.next != FIBER_SNAPSHOT_END) {
+        n = 0;
+        rcu_read_lock();
+        fibered_process_node = check_if_process_is_fibered(pid);
+        if (fibered_process_node == NULL) {
+            rcu_read_unlock();
+            ret = -ERR_NOT_FIBERED;
+            break;
+        }
+        while (n < min_t(unsigned long, params_kern.count - copied, FIBER_SNAPSHOT_CHUNK)) {
+            fiber_node = get_next_fiber_in_process(fibered_process_node, params_kern.next);
+            if (fiber_node == NULL) {
+                params_kern.next = FIBER_SNAPSHOT_END;
+                break;
+            }
+            record = &records[n++];
+            record->id = fiber_node->id;
+            record->state = READ_ONCE(fiber_node->state) == RUNNING;
+            record->run_by = fiber_node->run_by;
+            record->created_by = fiber_node->created_by;
+            record->flags = fiber_node->flags;
+            record->entry_point = fiber_node->entry_point;
+            record->success_activations = fiber_node->success_activations_count;
+            record->failed_activations = atomic_read(&fiber_node->failed_activations_count);
+            record->total_time = get_actual_fiber_time(fiber_node);
+            record->cpu_time = fiber_node->cpu_time;
+            record->cycles = fiber_node->perf_counts[FIBER_PERF_CYCLES];
+            record->instructions = fiber_node->perf_counts[FIBER_PERF_INSTRUCTIONS];
+            record->cache_misses = fiber_node->perf_counts[FIBER_PERF_CACHE_MISSES];
+            params_kern.next = FIBER_FID_SLOT(fiber_node->id) + 1;
+        }
+        rcu_read_unlock();
+        if (copy_to_user((fiber_snapshot_t *)params_kern.records + copied, records,
+                         n * sizeof(fiber_snapshot_t)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+        copied += n;
+    }
+    // the walk reached the end exactly when the array got full
+    if (ret == 0 && params_kern.next != FIBER_SNAPSHOT_END) {
+        rcu_read_lock();
+        fibered_process_node = check_if_process_is_fibered(pid);
+        if (fibered_process_node == NULL ||
+            get_next_fiber_in_process(fibered_process_node, params_kern.next) == NULL)
+            params_kern.next = FIBER_SNAPSHOT_END;
+        rcu_read_unlock();
+    }
+
+    kfree(records);
+    if (ret < 0) return ret;
+    if (put_user(params_kern.next, &params->next) != 0) return -EFAULT;
+    return copied;
+}
+
+/*
+ * Allocation of fibers
+ */
+
+/**
+ * @brief Allocate a fiber node
+ *
+ * # Implementation
+ * The node is taken from the free list of the current cpu in @ref fiber_cache_cpus, otherwise it
+ * is allocated from @ref fiber_cache on the NUMA node of the current cpu, so the fibers are close
+ * to the thread that creates them. Must be called without locks held, since it can sleep.
+ *
+ * @return fiber_node_t* the node, not initialized, or NULL if there is no memory
+ */
+static fiber_node_t *alloc_fiber_node() {
+    fiber_cache_cpu_t *cache_cpu;
+    fiber_node_t *fiber_node = NULL;
+
+    cache_cpu = get_cpu_ptr(&fiber_cache_cpus);
+    spin_lock_bh(&cache_cpu->lock);
+    if (!list_empty(&cache_cpu->free)) {
+        fiber_node = list_first_entry(&cache_cpu->free, fiber_node_t, list);
+        list_del(&fiber_node->list);
+        cache_cpu->count--;
+    }
+    spin_unlock_bh(&cache_cpu->lock);
+    put_cpu_ptr(&fiber_cache_cpus);
+    if (fiber_node != NULL) return fiber_node;
+    return kmem_cache_alloc_node(fiber_cache, GFP_KERNEL, numa_node_id());
+}
+
+/**
+ * @brief Free a fiber node
+ *
+ * # Implementation
+ * The node is kept in the free list of the current cpu, unless the list already has
+ * @ref FIBER_CACHE_CPU_MAX nodes or the node belongs to another NUMA node, in these cases it goes
+ * back to @ref fiber_cache. It is called also from the RCU callbacks, so the lists are protected
+ * against the softirqs.
+ *
+ * @param fiber_node the node, that must not be in any list
+ */
+static void free_fiber_node(fiber_node_t *fiber_node) {
+    fiber_cache_cpu_t *cache_cpu;
+    bool cached = false;
+
+    cache_cpu = get_cpu_ptr(&fiber_cache_cpus);
+    if (page_to_nid(virt_to_page(fiber_node)) == numa_node_id()) {
+        spin_lock_bh(&cache_cpu->lock);
+        if (cache_cpu->count < FIBER_CACHE_CPU_MAX) {
+            list_add(&fiber_node->list, &cache_cpu->free);
+            cache_cpu->count++;
+            cached = true;
+        }
+        spin_unlock_bh(&cache_cpu->lock);
+    }
+    put_cpu_ptr(&fiber_cache_cpus);
+    if (!cached) kmem_cache_free(fiber_cache, fiber_node);
+}
+
+/**
+ * @brief Free a fiber node together with its local storage
+ *
+ * The pages of the local storage that are still mapped are kept by the mappings.
+ *
+ * @param fiber_node the node, that must not be in any list
+ */
+static void release_fiber_node(fiber_node_t *fiber_node) {
+    unsigned i;
+
+    for (i = 0; i < FLS_CHUNKS; i++)
+        if (fiber_node->local_storage.chunks[i] != NULL)
+            __free_page(fiber_node->local_storage.chunks[i]);
+    free_fiber_node(fiber_node);
+}
+
+/**
+ * @brief Free a deleted fiber, the @c call_rcu callback of @ref delete_fiber
+ *
+ * @param rcu the @ref fiber::rcu field of the fiber to free
+ */
+static void destroy_fiber(struct rcu_head *rcu) {
+    release_fiber_node(container_of(rcu, fiber_node_t, rcu));
+}
+
+/**
+ * @brief Count the fiber nodes that @ref fiber_cache_shrinker can release
+ *
+ * @param shrinker
+ * @param sc
+ * @return unsigned long the number of nodes in the free lists of all the cpus
+ */
+static unsigned long fiber_cache_count(struct shrinker *shrinker, struct shrink_control *sc) {
+    unsigned long count = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) count += READ_ONCE(per_cpu_ptr(&fiber_cache_cpus, cpu)->count);
+    return count;
+}
+
+/**
+ * @brief Release up to `sc->nr_to_scan` fiber nodes of the free lists to @ref fiber_cache
+ *
+ * @param shrinker
+ * @param sc
+ * @return unsigned long the number of nodes released
+ */
+static unsigned long fiber_cache_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+    fiber_cache_cpu_t *cache_cpu;
+    fiber_node_t *fiber_node;
+    unsigned long freed = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        cache_cpu = per_cpu_ptr(&fiber_cache_cpus, cpu);
+        while (freed < sc->nr_to_scan) {
+            spin_lock_bh(&cache_cpu->lock);
+            fiber_node = list_first_entry_or_null(&cache_cpu->free, fiber_node_t, list);
+            if (fiber_node != NULL) {
+                list_del(&fiber_node->list);
+                cache_cpu->count--;
+            }
+            spin_unlock_bh(&cache_cpu->lock);
+            if (fiber_node == NULL) break;
+            kmem_cache_free(fiber_cache, fiber_node);
+            freed++;
+        }
+    }
+    return freed;
+}
+
 /*
  * Utils functions
  */
@@ -642,80 +2027,330 @@ err_precheck:
  *
  * # Implementation
  * For checking if the process is a fiber we need to find in the the @fibered_processes_list data
- * structure. This module implements the list of fibered process both as a linked structure than an
- * hash table. If `#define USE_HASH_LIST` is present the hash table is used for checking if the
- * process is fibered, this means that the macro @ref check_if_exists_hash (that relies on kernel
- * built-in function `hash_for_each_possible_safe`) is used, otherwise we loop in a the linked list
- * of fibered processes by using the macro @ref check_if_exists (that relies on
- * `list_for_each_entry_safe`).
+ * structure, that is a @c rhashtable keyed by pid. The table grows and shrinks automatically with
+ * the number of fibered processes, so the lookup stays constant time. The caller must be in a RCU
+ * read-side critical section or hold @ref fibered_processes_mutex.
  *
  * @param process_pid The pid of the process to check
  * @return fibered_process_node_t* The pointer to the @ref fibered_process_node_t or NULL if process
  * is not fibered
  */
 fibered_process_node_t *check_if_process_is_fibered(unsigned process_pid) {
-    fibered_process_node_t *fibered_process_node;
-#ifdef USE_HASH_LIST
-    check_if_exists_hash(fibered_process_node, fibered_processes_list.hash_table, pid, process_pid,
-                         hlist, fibered_process_node_t);
-#else
-    check_if_exists(fibered_process_node, &fibered_processes_list.list, pid, process_pid, list,
-                    fibered_process_node_t);
-#endif
-    return fibered_process_node;
+    pid_t pid = (pid_t)process_pid;
+    return rhashtable_lookup_fast(&fibered_processes_list.hash_table, &pid,
+                                  fibered_processes_params);
+}
+
+/**
+ * @brief Get the statistics of the table of the fibered processes
+ *
+ * # Implementation
+ * The chains of the buckets of the current table are walked under RCU, if the table is being
+ * resized the figures refer to the old one.
+ *
+ * @param stats the structure to fill
+ */
+void get_fibered_processes_stats(fibered_processes_stats_t *stats) {
+    struct rhashtable *ht = &fibered_processes_list.hash_table;
+    struct bucket_table *tbl;
+    struct rhash_head *pos;
+    unsigned i, chain_length;
+
+    memset(stats, 0, sizeof(fibered_processes_stats_t));
+    rcu_read_lock();
+    tbl = rht_dereference_rcu(ht->tbl, ht);
+    stats->buckets = tbl->size;
+    for (i = 0; i < tbl->size; i++) {
+        chain_length = 0;
+        rht_for_each_rcu(pos, tbl, i) chain_length++;
+        if (chain_length > 0) stats->used_buckets++;
+        if (chain_length > stats->max_chain_length) stats->max_chain_length = chain_length;
+    }
+    rcu_read_unlock();
+    stats->processes = atomic_read(&ht->nelems);
+}
+
+/**
+ * @brief Get the aggregate figures of the fibers of a process
+ *
+ * # Implementation
+ * The counters of the domains are summed, and the per cpu counters of the process, so the cost
+ * depends on the number of domains and of cpus, not on the number of fibers. Every thread of a
+ * domain is always running one fiber, so the running fibers are the threads. Must be called in a
+ * RCU read-side critical section.
+ *
+ * @param fibered_process_node the process
+ * @param summary the structure to fill
+ */
+void get_fibered_process_summary(fibered_process_node_t *fibered_process_node,
+                                 fibered_process_summary_t *summary) {
+    fibered_process_counters_t *counters;
+    fiber_domain_t *domain;
+    int cpu;
+
+    memset(summary, 0, sizeof(fibered_process_summary_t));
+    list_for_each_entry_rcu(domain, &fibered_process_node->domains, list) {
+        summary->domains++;
+        summary->fibers += READ_ONCE(domain->fibers_list.fibers_count);
+        summary->running += READ_ONCE(domain->threads_count);
+    }
+    for_each_possible_cpu(cpu) {
+        counters = per_cpu_ptr(fibered_process_node->counters, cpu);
+        summary->switches += READ_ONCE(counters->switches);
+        summary->failed_activations += READ_ONCE(counters->failed_activations);
+    }
+}
+
+/**
+ * @brief Get the histogram of the latency of the switches of a process
+ *
+ * The histograms of every cpu are summed, the buckets are described in
+ * @ref FIBER_LATENCY_BUCKETS. The histogram only fills while the domains of the process collect
+ * statistics, see @ref account_latency. Must be called in a RCU read-side critical section.
+ *
+ * @param fibered_process_node the process
+ * @param buckets filled with the @ref FIBER_LATENCY_BUCKETS counts
+ */
+void get_switch_latency(fibered_process_node_t *fibered_process_node, unsigned long *buckets) {
+    fibered_process_counters_t *counters;
+    int cpu, i;
+
+    memset(buckets, 0, FIBER_LATENCY_BUCKETS * sizeof(unsigned long));
+    for_each_possible_cpu(cpu) {
+        counters = per_cpu_ptr(fibered_process_node->counters, cpu);
+        for (i = 0; i < FIBER_LATENCY_BUCKETS; i++) buckets[i] += READ_ONCE(counters->latency[i]);
+    }
+}
+
+/**
+ * @brief Clear the histogram of the latency of the switches of a process
+ *
+ * The switches that are running while the histogram is cleared may still be counted in it. Must
+ * be called in a RCU read-side critical section.
+ *
+ * @param fibered_process_node the process
+ */
+void reset_switch_latency(fibered_process_node_t *fibered_process_node) {
+    fibered_process_counters_t *counters;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        counters = per_cpu_ptr(fibered_process_node->counters, cpu);
+        for (i = 0; i < FIBER_LATENCY_BUCKETS; i++) WRITE_ONCE(counters->latency[i], 0);
+    }
+}
+
+/**
+ * @brief Get the counters of the operations of all the processes
+ *
+ * The counters of every cpu are summed without stopping the updates, so the figures of the
+ * different operations can be a few operations apart.
+ *
+ * @param counters the structure to fill
+ */
+void get_fiber_counters(fiber_counters_t *counters) {
+    fiber_counters_t *cpu_counters;
+    int cpu;
+
+    memset(counters, 0, sizeof(fiber_counters_t));
+    for_each_possible_cpu(cpu) {
+        cpu_counters = per_cpu_ptr(&fiber_counters, cpu);
+        counters->conversions += READ_ONCE(cpu_counters->conversions);
+        counters->creations += READ_ONCE(cpu_counters->creations);
+        counters->deletions += READ_ONCE(cpu_counters->deletions);
+        counters->switches += READ_ONCE(cpu_counters->switches);
+        counters->failed_switches += READ_ONCE(cpu_counters->failed_switches);
+        counters->fls_ops += READ_ONCE(cpu_counters->fls_ops);
+        counters->exits += READ_ONCE(cpu_counters->exits);
+    }
+}
+
+/**
+ * @brief Get the fiber domain of a file of the device
+ *
+ * # Implementation
+ * The domain is kept in the `private_data` of the file, so no global lookup is needed. It is only
+ * returned if it belongs to the process of the calling thread, a file inherited from another
+ * process cannot be used. Must be called in a RCU read-side critical section.
+ *
+ * @param filp the file of the device
+ * @return fiber_domain_t* The domain or NULL if the process did not convert a thread through
+ * @p filp
+ */
+static fiber_domain_t *get_fiber_domain(struct file *filp) {
+    fiber_domain_t *domain = rcu_dereference(filp->private_data);
+    if (domain == NULL || domain->pid != current->tgid) return NULL;
+    return domain;
+}
+
+/**
+ * @brief Check if a thread has been converted to a fiber in the domain
+ *
+ * # Implementation
+ * The threads converted to fibers are kept in the hash table fiber_domain::threads, keyed by
+ * their pid, so the macro @ref check_if_exists_hash_rcu is used.
+ *
+ * @param domain The pointer to the fiber domain
+ * @param thread_pid The pid of the thread to check
+ * @return fibered_thread_node_t* The pointer to the @ref fibered_thread_node_t or NULL if the
+ * thread has never been converted to a fiber
+ */
+fibered_thread_node_t *check_if_thread_is_fibered(fiber_domain_t *domain, pid_t thread_pid) {
+    fibered_thread_node_t *fibered_thread_node;
+    check_if_exists_hash_rcu(fibered_thread_node, domain->threads, pid, thread_pid, hlist,
+                             fibered_thread_node_t);
+    return fibered_thread_node;
 }
 
 /**
  * @brief Check if the current thread is a fiber
  *
  * # Implementation
- * For checking if the current thread is a fiber we search for it in the linked list of fibers
- * belonging to the process. For doing this, the macro @ref check_if_exists is used.
+ * Every thread converted to a fiber has a @ref fibered_thread_node_t that points to the fiber it
+ * is running, kept up to date by @ref convert_thread_to_fiber and @ref switch_to_fiber, so the
+ * fiber is found without walking the list of fibers belonging to the domain.
  *
- * @param fiber_process_node The pointer to the element representing the current fibered process
+ * @param domain The pointer to the fiber domain
  * @return fiber_node_t* A pointer to the fiber element in the list of fibers
  */
-fiber_node_t *check_if_this_thread_is_fiber(fibered_process_node_t *fibered_process_node) {
-    fiber_node_t *current_fiber_node;
-    check_if_exists(current_fiber_node, &fibered_process_node->fibers_list.list, run_by,
-                    current->pid, list, fiber_node_t);
-    return current_fiber_node;
+fiber_node_t *check_if_this_thread_is_fiber(fiber_domain_t *domain) {
+    fibered_thread_node_t *fibered_thread_node;
+    fibered_thread_node = check_if_thread_is_fibered(domain, current->pid);
+    if (fibered_thread_node == NULL) return NULL;
+    return fibered_thread_node->running_fiber;
 }
 
 /**
- * @brief Check if the given @param fid is associated with an existing fiber
+ * @brief Check if the given @param fid is associated with an existing fiber of the domain
  *
  * # Implementation
- * For checking if a fiber exists we search for it in the linked list of fibers belonging to the
- * process passed as input. For doing this, the macro @ref check_if_exists is used.
+ * Fibers are indexed by @ref FIBER_FID_INDEX of their id in the fibers_list::fibers_idr of the
+ * domain passed as input, so the check is a single @c idr_find, which does not depend on the
+ * number of fibers of the domain. The index of a deleted fiber is reused, so the fiber in it
+ * must also have the generation of @p fid, see @ref FIBER_FID_GEN. This is called on every switch.
  *
- * @param fibered_process_node The pointer to the element representing the current fibered process
+ * @param domain The pointer to the fiber domain
  * @param fid The fiber id to check
  * @return fiber_node_t* A pointer to the fiber element in the list of fibers
  */
-fiber_node_t *check_if_fiber_exist(fibered_process_node_t *fibered_process_node, unsigned fid) {
-    fiber_node_t *current_fiber_node;
-    check_if_exists(current_fiber_node, &fibered_process_node->fibers_list.list, id, fid, list,
-                    fiber_node_t);
-    return current_fiber_node;
+fiber_node_t *check_if_fiber_exist(fiber_domain_t *domain, unsigned fid) {
+    fiber_node_t *fiber_node;
+
+    if ((fid >> (FIBER_FID_SLOT_BITS + FIBER_FID_GEN_BITS)) != 0) return NULL;
+    if (FIBER_FID_DOMAIN(fid) != domain->id) return NULL;
+    fiber_node = idr_find(&domain->fibers_list.fibers_idr, FIBER_FID_INDEX(fid));
+    if (fiber_node == NULL || fiber_node->id != fid) return NULL;
+    return fiber_node;
+}
+
+/**
+ * @brief Check if the given @param fid is associated with an existing fiber of the process
+ *
+ * # Implementation
+ * The domain is found by @ref FIBER_FID_DOMAIN of the id in the few domains of the process, then
+ * @ref check_if_fiber_exist is used. This is called on every open of `/proc/<pid>/fibers/<fid>`.
+ * Must be called in a RCU read-side critical section.
+ *
+ * @param fibered_process_node The pointer to the element representing the fibered process
+ * @param fid The fiber id to check
+ * @return fiber_node_t* A pointer to the fiber element in the list of fibers
+ */
+fiber_node_t *check_if_fiber_exist_in_process(fibered_process_node_t *fibered_process_node,
+                                              unsigned fid) {
+    fiber_domain_t *domain;
+    check_if_exists_rcu(domain, &fibered_process_node->domains, id, FIBER_FID_DOMAIN(fid), list,
+                        fiber_domain_t);
+    if (domain == NULL) return NULL;
+    return check_if_fiber_exist(domain, fid);
+}
+
+/**
+ * @brief Get the fiber of the process with the lowest slot that is not lower than @p slot
+ *
+ * # Implementation
+ * The slots are ordered by domain and then by index in the domain, see @ref FIBER_FID_SLOT, so
+ * the domains are tried in the order of their id and the fiber is searched with @c idr_get_next in
+ * fibers_list::fibers_idr, that skips the ids that are reserved but not yet filled. This is used
+ * for walking the fibers of a process one at a time, without keeping any cursor: the walk goes
+ * on from the slot of the last fiber plus one. Must be called in a RCU read-side critical section.
+ *
+ * @param fibered_process_node The pointer to the element representing the fibered process
+ * @param slot The lowest fiber slot to return
+ * @return fiber_node_t* The fiber or NULL if the process has no more fibers
+ */
+fiber_node_t *get_next_fiber_in_process(fibered_process_node_t *fibered_process_node,
+                                        unsigned slot) {
+    fiber_domain_t *domain;
+    fiber_node_t *fiber_node;
+    unsigned domain_id;
+    int index = FIBER_FID_INDEX(slot);
+
+    if (slot >= FIBER_MAX_SLOTS) return NULL;
+    for (domain_id = FIBER_FID_DOMAIN(slot); domain_id < FIBER_MAX_DOMAINS;
+         domain_id++, index = 0) {
+        if (!test_bit(domain_id, fibered_process_node->domains_ids)) continue;
+        check_if_exists_rcu(domain, &fibered_process_node->domains, id, domain_id, list,
+                            fiber_domain_t);
+        if (domain == NULL) continue;
+        fiber_node = idr_get_next(&domain->fibers_list.fibers_idr, &index);
+        if (fiber_node != NULL) return fiber_node;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get a chunk of the local storage of a fiber, installing a spare page if it is missing
+ *
+ * # Implementation
+ * The chunk is installed with a @c cmpxchg, so concurrent callers agree on a single page, the
+ * spare page is consumed only if it is installed. Can be called in a RCU read-side critical
+ * section, since it never allocates.
+ *
+ * @param fiber_node The fiber
+ * @param chunk_index The index of the chunk in fiber::local_storage
+ * @param spare_chunk A zeroed page to install if the chunk is missing, set to NULL if used
+ * @return struct page* The chunk or NULL if it is missing and there is no spare page
+ */
+struct page *get_fls_chunk(fiber_node_t *fiber_node, unsigned chunk_index,
+                           struct page **spare_chunk) {
+    struct page *chunk = READ_ONCE(fiber_node->local_storage.chunks[chunk_index]);
+    if (chunk != NULL || *spare_chunk == NULL) return chunk;
+    chunk = cmpxchg(&fiber_node->local_storage.chunks[chunk_index], NULL, *spare_chunk);
+    if (chunk != NULL) return chunk;
+    chunk = *spare_chunk;
+    *spare_chunk = NULL;
+    return chunk;
 }
 
 /**
  * @brief Compute the actual live total time for fiber
  *
+ * The time of a running fiber is the time until its last switch plus the time since then, on the
+ * monotonic clock.
+ *
  * @param current_fiber_node
- * @return unsigned long
+ * @return u64 the time in ns
  */
-unsigned long get_actual_fiber_time(fiber_node_t *current_fiber_node) {
-    struct timespec current_time_s;
-    unsigned long current_time, fiber_time;
+u64 get_actual_fiber_time(fiber_node_t *current_fiber_node) {
     // if the fiber is idle no need to compute time
-    if (current_fiber_node->state == IDLE) return current_fiber_node->total_time;
+    if (READ_ONCE(current_fiber_node->state) == IDLE) return current_fiber_node->total_time;
+    // the same if the clocks have not been started, see account_switch
+    if (current_fiber_node->time_last_switch == 0) return current_fiber_node->total_time;
     // if the fiber is currently running, compute the time from the last switch to now
-    getnstimeofday(&current_time_s);
-    // compute times in millis
-    current_time = current_time_s.tv_sec * 1000 + current_time_s.tv_nsec / 1000000;
-    fiber_time = current_fiber_node->time_last_switch.tv_sec * 1000 +
-                 current_fiber_node->time_last_switch.tv_nsec / 1000000;
-    return current_fiber_node->total_time + (current_time - fiber_time);
+    return current_fiber_node->total_time + ktime_get_ns() - current_fiber_node->time_last_switch;
+}
+
+/**
+ * @brief Get the time that the current thread spent on a cpu, in ns
+ *
+ * The scheduler accounts `sum_exec_runtime` only at the ticks and at the context switches, so the
+ * time since `exec_start` is added, on the clock of the scheduler of this cpu. The thread is not
+ * billed for the time it is preempted, so neither are its fibers. Must be called with preemption
+ * disabled.
+ *
+ * @return u64
+ */
+u64 get_current_cpu_time() {
+    s64 delta = local_clock() - current->se.exec_start;
+    return current->se.sum_exec_runtime + (delta > 0 ? delta : 0);
 }
\ No newline at end of file
@@ -37,6 +37,8 @@ static int device_release(struct inode *, struct file *);
 static ssize_t device_read(struct file *, char *, size_t, loff_t *);
 static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
 static long fiber_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int device_mmap(struct file *filp, struct vm_area_struct *vma);
+static vm_fault_t device_fault(struct vm_fault *vmf);
 
 /*
  * Variables
@@ -54,7 +56,14 @@ char *cmds[FIBER_IOC_MAXNR + 1] = {
     "FLS_FREE",                // 5
     "FLS_GET",                 // 6
     "FLS_SET",                 // 7
-    "EXIT"                     // 8
+    "EXIT",                    // 8
+    "BATCH",                   // 9
+    "SWITCH_TO_ANY",           // 10
+    "RQ_POLICY",               // 11
+    "STATS",                   // 12
+    "PERF",                    // 13
+    "SNAPSHOT",                // 14
+    "DELETE"                   // 15
 };
 
 // clang-format off
@@ -64,7 +73,12 @@ static struct file_operations fops = {
     .open = device_open,
     .release = device_release,
     .unlocked_ioctl = fiber_ioctl,
-    .compat_ioctl = fiber_ioctl
+    .compat_ioctl = fiber_ioctl,
+    .mmap = device_mmap
+};
+
+static const struct vm_operations_struct device_vm_ops = {
+    .fault = device_fault
 };
 // clang-format on
 
@@ -109,6 +123,8 @@ void destroy_device(void) {
  * syscalls.
  * Inspired by https://static.lwn.net/images/pdf/LDD3/ch06.pdf
  *
+ * No global lock is taken here, every operation works on the fiber domain of @p filp.
+ *
  * @param inode
  * @param filp
  * @param cmd command number
@@ -116,7 +132,6 @@ void destroy_device(void) {
  */
 static long fiber_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     int err = 0, retval = 0;
-    spin_lock_irqsave(&fiber_spinlock, irq_flags);
 #ifdef DEBUG
     printk(KERN_DEBUG MODULE_NAME DEVICE_LOG "IOCTL %s from pid %d, tgid %d", cmds[_IOC_NR(cmd)],
            current->pid, current->tgid);
@@ -148,28 +163,50 @@ static long fiber_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     case FIBER_IOCRESET:
         break;
     case FIBER_IOC_CONVERTTHREADTOFIBER:
-        retval = convert_thread_to_fiber();
+        retval = convert_thread_to_fiber(filp);
         break;
     case FIBER_IOC_CREATEFIBER:
-        retval = create_fiber((fiber_params_t *)arg);
+        retval = create_fiber(filp, (fiber_params_t *)arg);
         break;
     case FIBER_IOC_SWITCHTOFIBER:
-        retval = switch_to_fiber((unsigned)arg);
+        retval = switch_to_fiber(filp, (unsigned)arg);
         break;
     case FIBER_IOC_FLS_ALLOC:
-        retval = fls_alloc();
+        retval = fls_alloc(filp);
         break;
     case FIBER_IOC_FLS_FREE:
-        retval = fls_free((long)arg);
+        retval = fls_free(filp, (long)arg);
         break;
     case FIBER_IOC_FLS_GET:
-        retval = fls_get((fls_params_t *)arg);
+        retval = fls_get(filp, (fls_params_t *)arg);
         break;
     case FIBER_IOC_FLS_SET:
-        retval = fls_set((fls_params_t *)arg);
+        retval = fls_set(filp, (fls_params_t *)arg);
         break;
     case FIBER_IOC_EXIT:
-        retval = exit_fibered();
+        retval = exit_fibered(filp);
+        break;
+    case FIBER_IOC_BATCH:
+        retval = run_batch(filp, (fiber_batch_params_t *)arg);
+        break;
+    case FIBER_IOC_SWITCHTOANY:
+        retval = switch_to_any_fiber(filp, (long *)arg);
+        break;
+    case FIBER_IOC_RQ_POLICY:
+        retval = set_ready_queue_policy(filp, arg);
+        break;
+    case FIBER_IOC_STATS:
+        retval = set_stats_period(filp, arg);
+        break;
+    case FIBER_IOC_PERF:
+        retval = set_perf_counters(filp, arg);
+        break;
+    case FIBER_IOC_SNAPSHOT:
+        retval = snapshot_fibers((fiber_snapshot_params_t *)arg);
+        break;
+    case FIBER_IOC_DELETE:
+        retval = delete_fiber(filp, arg);
+        break;
     default:
         break;
     }
@@ -178,30 +215,68 @@ static long fiber_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
            cmds[_IOC_NR(cmd)], current->pid, current->tgid, retval);
 #endif
 out:
-    spin_unlock_irqrestore(&fiber_spinlock, irq_flags);
     return retval;
 }
 
 /*
  * Called when a process tries to open the device file, like
- * "cat /dev/mycharfile"
+ * "cat /dev/mycharfile". Every open is a new fiber domain, that is created by the first
+ * conversion of a thread made through the file. Every open also has its own address_space, so
+ * the mappings of the file are the only ones that unmap_mapping_range() on filp->f_mapping finds,
+ * instead of the ones of all the processes that opened the device.
  */
 static int device_open(struct inode *inode, struct file *filp) {
+    struct address_space *mapping;
+
     // if (is_device_open) return -EBUSY;
+    mapping = kmalloc(sizeof(struct address_space), GFP_KERNEL);
+    if (mapping == NULL) return -ENOMEM;
+    address_space_init_once(mapping);
+    mapping->host = inode;
+    mapping->a_ops = inode->i_mapping->a_ops;
+    mapping_set_gfp_mask(mapping, mapping_gfp_mask(inode->i_mapping));
+    filp->f_mapping = mapping;
+    // the misc device puts itself here, but the field holds the fiber domain of the file
+    filp->private_data = NULL;
     is_device_open++;
     try_module_get(THIS_MODULE);
     return SUCCESS;
 }
 
 /*
- * Called when a process closes the device file.
+ * Called when the last reference to the device file is dropped, this is where the data of the
+ * process that used the file is released.
  */
 static int device_release(struct inode *inode, struct file *filp) {
+    release_fibered(filp);
+    // the mappings hold a reference to the file, so none is left
+    kfree(filp->f_mapping);
     is_device_open--;
     module_put(THIS_MODULE);
     return SUCCESS;
 }
 
+/*
+ * Called when a process maps the device file. The mapping exposes the fiber local storage of the
+ * fibers of the domain of the file, see fls_get_page(), and it is not inherited by children.
+ */
+static int device_mmap(struct file *filp, struct vm_area_struct *vma) {
+    if (!(vma->vm_flags & VM_SHARED)) return -EINVAL;
+    vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &device_vm_ops;
+    return SUCCESS;
+}
+
+/*
+ * Called on the first access to a page of the mapping of the device file.
+ */
+static vm_fault_t device_fault(struct vm_fault *vmf) {
+    struct page *page = fls_get_page(vmf->vma->vm_file, vmf->pgoff);
+    if (page == NULL) return VM_FAULT_SIGBUS;
+    vmf->page = page;
+    return 0;
+}
+
 /*
  * Called when a process, which already opened the dev file, attempts to read
  * from it.
@@ -53,6 +53,8 @@ original_proc_setattr_t original_proc_setattr;
  */
 static int fiber_proc_pident_readdir(struct file *file, struct dir_context *ctx,
                                      const struct pid_entry *ents, unsigned int nents);
+static pident_ext_t *get_pident_ext(const struct pid_entry *ents, unsigned int nents,
+                                    pident_ext_t **spare_ext);
 
 /**
  * Fibers FS
@@ -60,9 +62,47 @@ static int fiber_proc_pident_readdir(struct file *file, struct dir_context *ctx,
 
 static int fiber_proc_open(struct inode *inode, struct file *file);
 static int fiber_proc_show(struct seq_file *sfile, void *v);
+static fiber_node_t *get_fiber_of_proc_file(struct file *file);
 static struct dentry *proc_fibers_dir_lookup(struct inode *dir, struct dentry *dentry,
                                              unsigned int flags);
 static int proc_fibers_dir_readdir(struct file *file, struct dir_context *ctx);
+static void show_fiber(struct seq_file *sfile, fiber_node_t *fiber_node);
+static int hashtable_proc_open(struct inode *inode, struct file *file);
+static int hashtable_proc_show(struct seq_file *sfile, void *v);
+static int stat_proc_open(struct inode *inode, struct file *file);
+static int stat_proc_show(struct seq_file *sfile, void *v);
+static int process_fibers_proc_open(struct inode *inode, struct file *file);
+static int summary_proc_open(struct inode *inode, struct file *file);
+static int process_summary_proc_open(struct inode *inode, struct file *file);
+static int summary_proc_show(struct seq_file *sfile, void *v);
+static int latency_proc_open(struct inode *inode, struct file *file);
+static int process_latency_proc_open(struct inode *inode, struct file *file);
+static int latency_proc_show(struct seq_file *sfile, void *v);
+static ssize_t latency_proc_write(struct file *file, const char __user *buf, size_t count,
+                                  loff_t *ppos);
+static void *process_fibers_seq_start(struct seq_file *sfile, loff_t *pos);
+static void *process_fibers_seq_next(struct seq_file *sfile, void *v, loff_t *pos);
+static void process_fibers_seq_stop(struct seq_file *sfile, void *v);
+static int process_fibers_seq_show(struct seq_file *sfile, void *v);
+
+/**
+ * @brief The /proc/fibers directory, that contains the files global to the module
+ */
+static struct proc_dir_entry *proc_fibers_root;
+
+/**
+ * @brief Whether the `fibers` directory is added to /proc/<PID> by hooking @c proc_pident_readdir,
+ * otherwise the fibers are only in /proc/fibers/<PID>
+ */
+static bool proc_hook = true;
+module_param(proc_hook, bool, 0444);
+MODULE_PARM_DESC(proc_hook, "Add the fibers directory to /proc/<pid> by hooking proc, the fibers "
+                            "are always in /proc/fibers/<pid>");
+
+/**
+ * @brief The entries arrays of @c proc_pident_readdir already extended, see pident_ext_t
+ */
+static pident_ext_t *pident_cache[PROC_PIDENT_CACHE_SIZE];
 
 // clang-format off
 static struct inode_operations proc_fibers_folder_inode_operations; /* = {
@@ -85,6 +125,80 @@ static struct file_operations fiber_proc_file_ops = {
     .llseek = seq_lseek,
     .release = seq_release
 };
+
+static struct file_operations hashtable_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = hashtable_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static struct file_operations stat_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = stat_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static struct file_operations summary_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = summary_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static struct file_operations process_summary_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = process_summary_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static struct file_operations latency_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = latency_proc_open,
+    .read = seq_read,
+    .write = latency_proc_write,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static struct file_operations process_latency_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = process_latency_proc_open,
+    .read = seq_read,
+    .write = latency_proc_write,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static const struct seq_operations process_fibers_seq_ops = {
+    .start = process_fibers_seq_start,
+    .next = process_fibers_seq_next,
+    .stop = process_fibers_seq_stop,
+    .show = process_fibers_seq_show
+};
+
+static struct file_operations process_fibers_proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = process_fibers_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release
+};
+
+/**
+ * @brief The files of a process in /proc/<PID>/fibers, beside the ones of its fibers
+ */
+static const struct pid_entry process_entries[] = {
+    REG(PROC_SUMMARY_ENTRY, S_IRUGO, summary_proc_file_ops),
+    REG(PROC_LATENCY_ENTRY, S_IRUGO | S_IWUSR, latency_proc_file_ops)
+};
+#define PROC_PROCESS_ENTRIES ((int)ARRAY_SIZE(process_entries))
 // clang-format on
 
 static struct ftrace_hook hooked_functions[] = {
@@ -100,7 +214,10 @@ static struct ftrace_hook hooked_functions[] = {
  *
  * # Implementation
  * The init function of the proc module firstly retrieve all functions needed to be called and that
- * are not accessible with the kernel headers, then it installs the ftrace hook. All begin from this.
+ * are not accessible with the kernel headers, then it installs the ftrace hook, unless the
+ * `proc_hook` parameter is disabled. Finally it creates the /proc/fibers directory with the files
+ * that are global to the module, where every fibered process gets its own directory, see
+ * @ref proc_register_process.
  *
  * @return int
  */
@@ -123,11 +240,24 @@ int init_proc() {
     proc_fibers_folder_inode_operations.getattr = original_pid_getattr;
     proc_fibers_folder_inode_operations.setattr = original_proc_setattr;
     // install hook with ftrace
-    ret = fh_install_hook(&hooked_functions[0]);
+    if (proc_hook) ret = fh_install_hook(&hooked_functions[0]);
     if (ret < 0) goto err;
+    // create the global files
+    proc_fibers_root = proc_mkdir(PROC_FOLDER, NULL);
+    if (proc_fibers_root == NULL) goto err_hook;
+    if (proc_create(PROC_HASHTABLE_ENTRY, 0444, proc_fibers_root, &hashtable_proc_file_ops) == NULL)
+        goto err_root;
+    if (proc_create(PROC_STAT_ENTRY, 0444, proc_fibers_root, &stat_proc_file_ops) == NULL)
+        goto err_root;
     printk(KERN_DEBUG MODULE_NAME PROC_LOG "/proc/<PID>/" PROC_ENTRY " registering success");
     goto out;
 
+err_root:
+    remove_proc_subtree(PROC_FOLDER, NULL);
+    proc_fibers_root = NULL;
+err_hook:
+    if (proc_hook) fh_remove_hook(&hooked_functions[0]);
+    ret = -ENOMEM;
 err:
     printk(KERN_ALERT MODULE_NAME PROC_LOG "/proc/<PID>/" PROC_ENTRY " registering error");
     if (ret == 0) ret = -1;
@@ -140,7 +270,12 @@ out:
  *
  */
 void destroy_proc() {
-    fh_remove_hook(&hooked_functions[0]);
+    int i;
+
+    if (proc_fibers_root != NULL) remove_proc_subtree(PROC_FOLDER, NULL);
+    proc_fibers_root = NULL;
+    if (proc_hook) fh_remove_hook(&hooked_functions[0]);
+    for (i = 0; i < PROC_PIDENT_CACHE_SIZE; i++) kfree(pident_cache[i]);
     printk(KERN_DEBUG MODULE_NAME PROC_LOG "/proc/" PROC_ENTRY " destroyed");
 }
 
@@ -151,6 +286,11 @@ void destroy_proc() {
  * displayed inside /proc/<PID> and the call the original function. We only do this if we are in
  * the <PID> directory, otherwise we immediately fallback to the original function
  *
+ * # Implementation
+ * The hook runs for every directory of proc that is listed on the system, so it returns at once if
+ * no process is fibered. The arrays of entries that it receives are the static tables of proc, so
+ * each of them is extended with our entry only once, see @ref get_pident_ext.
+ *
  * @param file
  * @param ctx
  * @param ents
@@ -160,27 +300,25 @@ void destroy_proc() {
 static int fiber_proc_pident_readdir(struct file *file, struct dir_context *ctx,
                                      const struct pid_entry *ents, unsigned int nents) {
     int res;
-    struct pid_entry *ents_copy;
+    pident_ext_t *pident_ext, *spare_ext = NULL;
     unsigned long curr_pid; // the currently displayed pid, if it is the case
     fibered_process_node_t *fibered_process_node;
-    struct pid_entry fibers_dir =
-        DIR(PROC_FOLDER, S_IRUGO | S_IXUGO, proc_fibers_folder_inode_operations,
-            proc_fibers_folder_operations); // our dir, if it is the case
 
+    if (atomic_read(&fibered_processes_list.hash_table.nelems) == 0) goto original;
     // check if we are in a /<PID> directory
     if (kstrtoul(file->f_path.dentry->d_iname, 10, &curr_pid) != 0) goto original;
     // check if process is fibered
+    rcu_read_lock();
     fibered_process_node = check_if_process_is_fibered(curr_pid);
+    rcu_read_unlock();
     // if process is not fibered we do not display the /proc/<PID>/fibers folder
     if (fibered_process_node == NULL) goto original;
     // otherwise add the /fibers entry
-    // -> copy the ents array
-    ents_copy = kzalloc((nents + 1) * sizeof(struct pid_entry), GFP_KERNEL);
-    memcpy(ents_copy, ents, nents * sizeof(struct pid_entry));
-    // -> add our entry
-    memcpy(&ents_copy[nents], &fibers_dir, sizeof(struct pid_entry));
-    res = original_proc_pident_readdir(file, ctx, ents_copy, nents + 1);
-    kfree(ents_copy);
+    pident_ext = get_pident_ext(ents, nents, &spare_ext);
+    if (pident_ext == NULL) goto original;
+    res = original_proc_pident_readdir(file, ctx, pident_ext->ext, nents + 1);
+    // the cache is full, the array has only been used for this call
+    kfree(spare_ext);
     goto out;
 
 original:
@@ -189,6 +327,43 @@ out:
     return res;
 }
 
+/**
+ * @brief Get the entries of a /proc/<PID> directory extended with our `fibers` directory
+ *
+ * The array is searched in @ref pident_cache, otherwise it is allocated and added to the cache
+ * with a @c cmpxchg, so concurrent readers agree on a single copy. If the cache is full the array
+ * is returned in @p spare_ext and must be freed by the caller.
+ *
+ * @param ents the entries passed to @c proc_pident_readdir
+ * @param nents the number of entries
+ * @param spare_ext set to the array if it is not kept in the cache
+ * @return pident_ext_t* the extended array, NULL if there is no memory
+ */
+static pident_ext_t *get_pident_ext(const struct pid_entry *ents, unsigned int nents,
+                                    pident_ext_t **spare_ext) {
+    pident_ext_t *pident_ext;
+    struct pid_entry fibers_dir =
+        DIR(PROC_FOLDER, S_IRUGO | S_IXUGO, proc_fibers_folder_inode_operations,
+            proc_fibers_folder_operations); // our dir
+    int i;
+
+    for (i = 0; i < PROC_PIDENT_CACHE_SIZE; i++) {
+        pident_ext = READ_ONCE(pident_cache[i]);
+        if (pident_ext == NULL) break;
+        if (pident_ext->ents == ents && pident_ext->nents == nents) return pident_ext;
+    }
+    pident_ext = kmalloc(sizeof(pident_ext_t) + (nents + 1) * sizeof(struct pid_entry), GFP_KERNEL);
+    if (pident_ext == NULL) return NULL;
+    pident_ext->ents = ents;
+    pident_ext->nents = nents;
+    memcpy(pident_ext->ext, ents, nents * sizeof(struct pid_entry));
+    memcpy(&pident_ext->ext[nents], &fibers_dir, sizeof(struct pid_entry));
+    for (; i < PROC_PIDENT_CACHE_SIZE; i++)
+        if (cmpxchg(&pident_cache[i], NULL, pident_ext) == NULL) return pident_ext;
+    *spare_ext = pident_ext;
+    return pident_ext;
+}
+
 /*
  * Ftrace area
  * @see https://www.apriorit.com/dev-blog/546-hooking-linux-functions-2
@@ -277,79 +452,15 @@ void fh_remove_hook(struct ftrace_hook *hook) {
  * Implementation of static functions
  */
 
-/**
- * @brief Dynamically generate an array of @c pid_entry in which every entry is a regular
- * file that represents a fiber.
- *
- * Caller needs to free memory!
- *
- * @param pid The pid string
- * @return struct pid_entry** Here the function will put the allocated array
- */
-static int generate_fibers_dir_stuff(char *pid_str, struct pid_entry **to_out) {
-    fibered_process_node_t *fibered_process_node;
-    fiber_node_t *fiber_cursor_temp, *fiber_cursor_temp_safe;
-    char namebuf[NAME_MAX]; // buffer for filenames
-    char *temp_name;
-    unsigned long pid;
-
-    int i = 0;
-    int ret = 0;
-
-    // check if pid is valid
-    if (kstrtoul(pid_str, 10, &pid) != 0) goto err;
-
-    // checks
-    fibered_process_node = check_if_process_is_fibered(pid);
-    if (fibered_process_node == NULL) goto err;
-    if (fibered_process_node->fibers_list.fibers_count == 0) goto out;
-    *to_out = kzalloc(sizeof(struct pid_entry) * fibered_process_node->fibers_list.fibers_count,
-                      GFP_KERNEL);
-
-    list_for_each_entry_safe(fiber_cursor_temp, fiber_cursor_temp_safe,
-                             &fibered_process_node->fibers_list.list, list) {
-        // copy the name
-        ret = snprintf(namebuf, NAME_MAX, "%d", fiber_cursor_temp->id);
-        if (ret <= 0) continue;
-        temp_name = kmalloc(ret + 1, GFP_KERNEL);
-        memcpy(temp_name, namebuf, ret + 1);
-        (*to_out)[i].name = temp_name;
-        (*to_out)[i].len = ret;
-        // other params
-        (*to_out)[i].mode = S_IFREG | S_IRUGO | S_IWUGO;
-        (*to_out)[i].iop = NULL;
-        (*to_out)[i].fop = &fiber_proc_file_ops;
-
-        i++;
-    }
-
-    ret = (int)fibered_process_node->fibers_list.fibers_count;
-    goto out;
-
-err:
-    printk(KERN_ALERT MODULE_NAME PROC_LOG "generate_fibers_dir_stuff() error");
-    ret = -1;
-out:
-    return ret;
-}
-
-/**
- * @brief Destroy fibers dir stuff
- *
- * Completely deallocate the array of pid_entry dynamically generated for a process
- *
- * @param fibers_stuff
- * @param nents
- */
-void destroy_fibers_dir_stuff(struct pid_entry *fibers_stuff, int nents) {
-    int i;
-    for (i = 0; i < nents; i++) kfree(fibers_stuff[i].name);
-    kfree(fibers_stuff);
-}
-
 /**
  * @brief Implements the assignment to every entry in dir /proc/<PID>/fibers
  *
+ * # Implementation
+ * The name of the entry is the id of a fiber, so the fiber is found with
+ * @ref check_if_fiber_exist_in_process and the original lookup is called with a single
+ * @c pid_entry for it, that takes its name from @p dentry, nothing is allocated. The other entries
+ * are the files of the process in @ref process_entries.
+ *
  * @param dir
  * @param dentry
  * @param flags
@@ -357,40 +468,81 @@ void destroy_fibers_dir_stuff(struct pid_entry *fibers_stuff, int nents) {
  */
 static struct dentry *proc_fibers_dir_lookup(struct inode *dir, struct dentry *dentry,
                                              unsigned int flags) {
-    int ret, nents = 0;
-    struct dentry *res = NULL;
-    struct pid_entry *fibers_dir_stuff;
+    fibered_process_node_t *fibered_process_node;
+    fiber_node_t *fiber_node = NULL;
+    struct pid_entry fiber_entry = REG("", S_IRUGO | S_IWUGO, fiber_proc_file_ops);
     struct dentry *curr_dentry = container_of(dir->i_dentry.first, struct dentry, d_u.d_alias);
     struct dentry *parent_dentry = curr_dentry->d_parent;
-    nents = ret = generate_fibers_dir_stuff(parent_dentry->d_iname, &fibers_dir_stuff);
-    if (ret < 0) goto out;
-    // call the original
-    res = original_proc_pident_lookup(dir, dentry, fibers_dir_stuff, nents);
+    unsigned long pid;
+    unsigned fid;
+    int i;
 
-    destroy_fibers_dir_stuff(fibers_dir_stuff, nents);
-out:
-    return res;
+    if (kstrtoul(parent_dentry->d_iname, 10, &pid) != 0) return ERR_PTR(-ENOENT);
+    for (i = 0; i < PROC_PROCESS_ENTRIES; i++)
+        if (strcmp(dentry->d_name.name, process_entries[i].name) == 0)
+            return original_proc_pident_lookup(dir, dentry, &process_entries[i], 1);
+    // only the names given by readdir, so no leading zeros
+    if (kstrtouint(dentry->d_name.name, 10, &fid) != 0) return ERR_PTR(-ENOENT);
+    if (dentry->d_name.len > 1 && dentry->d_name.name[0] == '0') return ERR_PTR(-ENOENT);
+    rcu_read_lock();
+    fibered_process_node = check_if_process_is_fibered(pid);
+    if (fibered_process_node != NULL)
+        fiber_node = check_if_fiber_exist_in_process(fibered_process_node, fid);
+    rcu_read_unlock();
+    if (fiber_node == NULL) return ERR_PTR(-ENOENT);
+    // call the original
+    fiber_entry.name = dentry->d_name.name;
+    fiber_entry.len = dentry->d_name.len;
+    return original_proc_pident_lookup(dir, dentry, &fiber_entry, 1);
 }
 
 /**
  * @brief Implements the reading of the /proc/<PID>/fibers dir
  *
+ * # Implementation
+ * The files of the process in @ref process_entries come first, then the entries are streamed
+ * from the fibers of the process, one at a time with @ref get_next_fiber_in_process, instead of
+ * building the whole directory at every call. The position of the directory after those files is
+ * the slot of the next fiber to emit, see @ref FIBER_FID_SLOT, plus the dots and the files, so the
+ * reading is resumed correctly even if fibers have been created or deleted in the meantime. The
+ * fibers are only looked up under RCU, the entries are emitted out of it since copying them to
+ * user space can sleep. Like proc does when it cannot instantiate an entry, the inode number is 1,
+ * the inode is created by the lookup.
+ *
  * @param file
  * @param ctx
  * @return int
  */
 static int proc_fibers_dir_readdir(struct file *file, struct dir_context *ctx) {
-    int ret, nents;
-    struct pid_entry *fibers_dir_stuff;
-    char *pid_str = file->f_path.dentry->d_parent->d_iname;
-    nents = ret = generate_fibers_dir_stuff(pid_str, &fibers_dir_stuff);
-    if (ret < 0) goto out;
-    // call the original readdir
-    ret = original_proc_pident_readdir(file, ctx, fibers_dir_stuff, nents);
-
-    destroy_fibers_dir_stuff(fibers_dir_stuff, nents);
-out:
-    return ret;
+    fibered_process_node_t *fibered_process_node;
+    fiber_node_t *fiber_node;
+    char namebuf[PROC_FIBER_NAME_SIZE];
+    unsigned long pid;
+    unsigned fid;
+    int len;
+
+    if (!dir_emit_dots(file, ctx)) return 0;
+    if (kstrtoul(file->f_path.dentry->d_parent->d_iname, 10, &pid) != 0) return -ENOENT;
+    for (; ctx->pos < 2 + PROC_PROCESS_ENTRIES; ctx->pos++)
+        if (!dir_emit(ctx, process_entries[ctx->pos - 2].name, process_entries[ctx->pos - 2].len, 1,
+                      DT_REG))
+            return 0;
+    while (ctx->pos - 2 - PROC_PROCESS_ENTRIES < FIBER_MAX_SLOTS) {
+        fiber_node = NULL;
+        rcu_read_lock();
+        fibered_process_node = check_if_process_is_fibered(pid);
+        if (fibered_process_node != NULL)
+            fiber_node = get_next_fiber_in_process(fibered_process_node,
+                                                   ctx->pos - 2 - PROC_PROCESS_ENTRIES);
+        if (fiber_node != NULL) fid = fiber_node->id;
+        rcu_read_unlock();
+        if (fiber_node == NULL) break;
+        len = snprintf(namebuf, sizeof(namebuf), "%u", fid);
+        ctx->pos = FIBER_FID_SLOT(fid) + 2 + PROC_PROCESS_ENTRIES;
+        if (!dir_emit(ctx, namebuf, len, 1, DT_REG)) break;
+        ctx->pos++;
+    }
+    return 0;
 }
 
 /**
@@ -405,20 +557,15 @@ out:
  */
 static int fiber_proc_open(struct inode *inode, struct file *file) {
     int ret;
-    unsigned long pid, fid;
-    fibered_process_node_t *fibered_process;
     fiber_node_t *fiber_node;
 
-    // we are in /proc/<PID>/fibers/<FID>
-    if (kstrtoul(file->f_path.dentry->d_name.name, 10, &fid) != 0) goto err;
-    if (kstrtoul(file->f_path.dentry->d_parent->d_parent->d_name.name, 10, &pid) != 0) goto err;
-
-    fibered_process = check_if_process_is_fibered(pid);
-    if (fibered_process == NULL) goto err;
-    fiber_node = check_if_fiber_exist(fibered_process, fid);
+    rcu_read_lock();
+    fiber_node = get_fiber_of_proc_file(file);
+    rcu_read_unlock();
     if (fiber_node == NULL) goto err;
 
-    ret = single_open(file, fiber_proc_show, fiber_node);
+    // the fiber is looked up again at every show, since it can be freed while the file is open
+    ret = single_open(file, fiber_proc_show, NULL);
     goto out;
 err:
     ret = -1;
@@ -435,19 +582,388 @@ out:
  * @return int
  */
 static int fiber_proc_show(struct seq_file *sfile, void *p) {
-    fiber_node_t *fiber_node = (fiber_node_t *)sfile->private;
+    fiber_node_t *fiber_node;
+
+    rcu_read_lock();
+    fiber_node = get_fiber_of_proc_file(sfile->file);
+    if (fiber_node != NULL) show_fiber(sfile, fiber_node);
+    rcu_read_unlock();
+    return 0;
+}
+
+/**
+ * @brief Show the information of a fiber, must be called in a RCU read-side critical section
+ *
+ * @param sfile
+ * @param fiber_node
+ */
+static void show_fiber(struct seq_file *sfile, fiber_node_t *fiber_node) {
     seq_printf(sfile, "%-30s : %u\n", "fiber id", fiber_node->id);
     seq_printf(sfile, "%-30s : %#lx\n", "entry point", fiber_node->entry_point);
     seq_printf(sfile, "%-30s : %s\n", "state", fiber_node->state == 0 ? "IDLE" : "RUNNING");
     if (fiber_node->state == 1)
         seq_printf(sfile, "%-30s : %u\n", "running thread id", (unsigned)fiber_node->run_by);
     seq_printf(sfile, "%-30s : %u\n", "initiator thread id", (unsigned)fiber_node->created_by);
-    seq_printf(sfile, "%-30s : %lu\n", "total execution time (ms)",
+    seq_printf(sfile, "%-30s : %llu\n", "total execution time (ns)",
                get_actual_fiber_time(fiber_node));
+    // the cpu time of a running fiber is only known by the thread running it, until its last switch
+    seq_printf(sfile, "%-30s : %llu\n", "cpu time (ns)", fiber_node->cpu_time);
     seq_printf(sfile, "%-30s : %u\n", "successful activations",
                fiber_node->success_activations_count);
-    seq_printf(sfile, "%-30s : %u\n", "failed activations", fiber_node->failed_activations_count);
+    seq_printf(sfile, "%-30s : %u\n", "failed activations",
+               (unsigned)atomic_read(&fiber_node->failed_activations_count));
+    // the hardware counters, only collected if the process enabled them, until the last switch
+    seq_printf(sfile, "%-30s : %llu\n", "cpu cycles", fiber_node->perf_counts[FIBER_PERF_CYCLES]);
+    seq_printf(sfile, "%-30s : %llu\n", "instructions",
+               fiber_node->perf_counts[FIBER_PERF_INSTRUCTIONS]);
+    seq_printf(sfile, "%-30s : %llu\n", "cache misses",
+               fiber_node->perf_counts[FIBER_PERF_CACHE_MISSES]);
     // seq_printf(sfile, "\nAdvanced Information\n---------------------\n");
     // seq_printf(sfile, "%-30s : %#lx\n", "stack address", fiber_node->base_user_stack_addr);
+}
+
+/**
+ * @brief Get the fiber that is represented by a `/proc/<PID>/fibers/<FID>` file
+ *
+ * Must be called in a RCU read-side critical section, the fiber cannot be used outside of it.
+ *
+ * @param file
+ * @return fiber_node_t* the fiber or NULL if it does not exist anymore
+ */
+static fiber_node_t *get_fiber_of_proc_file(struct file *file) {
+    unsigned long pid, fid;
+    fibered_process_node_t *fibered_process;
+
+    // we are in /proc/<PID>/fibers/<FID>
+    if (kstrtoul(file->f_path.dentry->d_name.name, 10, &fid) != 0) return NULL;
+    if (kstrtoul(file->f_path.dentry->d_parent->d_parent->d_name.name, 10, &pid) != 0) return NULL;
+
+    fibered_process = check_if_process_is_fibered(pid);
+    if (fibered_process == NULL) return NULL;
+    return check_if_fiber_exist_in_process(fibered_process, fid);
+}
+/**
+ * @brief Open the `/proc/fibers/hashtable` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int hashtable_proc_open(struct inode *inode, struct file *file) {
+    return single_open(file, hashtable_proc_show, NULL);
+}
+
+/**
+ * @brief Show the occupancy of the table of the fibered processes
+ *
+ * @param sfile
+ * @param v
+ * @return int
+ */
+static int hashtable_proc_show(struct seq_file *sfile, void *v) {
+    fibered_processes_stats_t stats;
+
+    get_fibered_processes_stats(&stats);
+    seq_printf(sfile, "%-30s : %u\n", "fibered processes", stats.processes);
+    seq_printf(sfile, "%-30s : %u\n", "buckets", stats.buckets);
+    seq_printf(sfile, "%-30s : %u\n", "used buckets", stats.used_buckets);
+    seq_printf(sfile, "%-30s : %u\n", "max chain length", stats.max_chain_length);
+    return 0;
+}
+
+/**
+ * @brief Open the `/proc/fibers/stat` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int stat_proc_open(struct inode *inode, struct file *file) {
+    return single_open(file, stat_proc_show, NULL);
+}
+
+/**
+ * @brief Show the counters of the operations of all the processes since the module was loaded
+ *
+ * @param sfile
+ * @param v
+ * @return int
+ */
+static int stat_proc_show(struct seq_file *sfile, void *v) {
+    fiber_counters_t counters;
+
+    get_fiber_counters(&counters);
+    seq_printf(sfile, "%-30s : %lu\n", "conversions", counters.conversions);
+    seq_printf(sfile, "%-30s : %lu\n", "creations", counters.creations);
+    seq_printf(sfile, "%-30s : %lu\n", "deletions", counters.deletions);
+    seq_printf(sfile, "%-30s : %lu\n", "switches", counters.switches);
+    seq_printf(sfile, "%-30s : %lu\n", "failed switches", counters.failed_switches);
+    seq_printf(sfile, "%-30s : %lu\n", "fls operations", counters.fls_ops);
+    seq_printf(sfile, "%-30s : %lu\n", "exits", counters.exits);
+    return 0;
+}
+
+/**
+ * @brief Create the /proc/fibers/<PID> directory of a process that became fiber-enabled
+ *
+ * The directory does not depend on the hook of /proc/<PID>, so it is cheap to sweep for a monitor:
+ * it contains a file with all the fibers of the process, its summary and the latency of its
+ * switches. The pid is kept as the data of
+ * the entries, the process is looked up at every read. A failure is not fatal for the process,
+ * its fibers are only missing from the directory. Must be called holding the mutex of the core.
+ *
+ * @param fibered_process_node the process
+ */
+void proc_register_process(fibered_process_node_t *fibered_process_node) {
+    char name[PROC_FIBER_NAME_SIZE];
+    void *data = (void *)(long)fibered_process_node->pid;
+
+    fibered_process_node->proc_dir = NULL;
+    if (proc_fibers_root == NULL) return;
+    snprintf(name, sizeof(name), "%d", fibered_process_node->pid);
+    fibered_process_node->proc_dir = proc_mkdir_data(name, 0555, proc_fibers_root, data);
+    if (fibered_process_node->proc_dir == NULL) goto err;
+    if (proc_create_data(PROC_PROCESS_FIBERS_ENTRY, 0444, fibered_process_node->proc_dir,
+                         &process_fibers_proc_file_ops, data) == NULL)
+        goto err;
+    if (proc_create_data(PROC_SUMMARY_ENTRY, 0444, fibered_process_node->proc_dir,
+                         &process_summary_proc_file_ops, data) == NULL)
+        goto err;
+    if (proc_create_data(PROC_LATENCY_ENTRY, 0644, fibered_process_node->proc_dir,
+                         &process_latency_proc_file_ops, data) == NULL)
+        goto err;
+    return;
+
+err:
+    printk(KERN_ALERT MODULE_NAME PROC_LOG "proc_register_process() error for pid %d",
+           fibered_process_node->pid);
+    proc_remove(fibered_process_node->proc_dir);
+    fibered_process_node->proc_dir = NULL;
+}
+
+/**
+ * @brief Remove the /proc/fibers/<PID> directory of a process that is no more fiber-enabled
+ *
+ * Must be called holding the mutex of the core.
+ *
+ * @param fibered_process_node the process
+ */
+void proc_unregister_process(fibered_process_node_t *fibered_process_node) {
+    proc_remove(fibered_process_node->proc_dir);
+    fibered_process_node->proc_dir = NULL;
+}
+
+/**
+ * @brief Open the `/proc/fibers/<PID>/fibers` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int process_fibers_proc_open(struct inode *inode, struct file *file) {
+    int ret = seq_open(file, &process_fibers_seq_ops);
+    if (ret == 0) ((struct seq_file *)file->private_data)->private = PDE_DATA(inode);
+    return ret;
+}
+
+/**
+ * @brief Start the walk of the fibers of the process of the file
+ *
+ * # Implementation
+ * The position is the slot of the next fiber to show, so the walk is resumed by
+ * @ref get_next_fiber_in_process between two reads, without any cursor. The walk is done in a RCU
+ * read-side critical section that lasts until @ref process_fibers_seq_stop.
+ *
+ * @param sfile
+ * @param pos
+ * @return void* the fiber or NULL at the end
+ */
+static void *process_fibers_seq_start(struct seq_file *sfile, loff_t *pos) {
+    fibered_process_node_t *fibered_process_node;
+    fiber_node_t *fiber_node = NULL;
+
+    rcu_read_lock();
+    if (*pos >= FIBER_MAX_SLOTS) return NULL;
+    fibered_process_node = check_if_process_is_fibered((long)sfile->private);
+    if (fibered_process_node != NULL)
+        fiber_node = get_next_fiber_in_process(fibered_process_node, *pos);
+    if (fiber_node != NULL) *pos = FIBER_FID_SLOT(fiber_node->id);
+    return fiber_node;
+}
+
+static void *process_fibers_seq_next(struct seq_file *sfile, void *v, loff_t *pos) {
+    *pos = FIBER_FID_SLOT(((fiber_node_t *)v)->id) + 1;
+    rcu_read_unlock();
+    return process_fibers_seq_start(sfile, pos);
+}
+
+static void process_fibers_seq_stop(struct seq_file *sfile, void *v) { rcu_read_unlock(); }
+
+static int process_fibers_seq_show(struct seq_file *sfile, void *v) {
+    show_fiber(sfile, v);
+    seq_putc(sfile, '\n');
+    return 0;
+}
+
+/**
+ * @brief Open the `/proc/<PID>/fibers/summary` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int summary_proc_open(struct inode *inode, struct file *file) {
+    unsigned long pid;
+
+    // we are in /proc/<PID>/fibers/summary
+    if (kstrtoul(file->f_path.dentry->d_parent->d_parent->d_name.name, 10, &pid) != 0)
+        return -ENOENT;
+    return single_open(file, summary_proc_show, (void *)pid);
+}
+
+/**
+ * @brief Open the `/proc/fibers/<PID>/summary` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int process_summary_proc_open(struct inode *inode, struct file *file) {
+    return single_open(file, summary_proc_show, PDE_DATA(inode));
+}
+
+/**
+ * @brief Show the aggregate figures of a process and the switches of each of its threads
+ *
+ * # Implementation
+ * The figures are computed by @ref get_fibered_process_summary from the counters that the
+ * switches keep, then the threads of every domain are listed, so the cost does not depend on the
+ * number of fibers.
+ *
+ * @param sfile
+ * @param v
+ * @return int
+ */
+static int summary_proc_show(struct seq_file *sfile, void *v) {
+    fibered_process_node_t *fibered_process_node;
+    fibered_process_summary_t summary;
+    fibered_thread_node_t *fibered_thread_node;
+    fiber_domain_t *domain;
+    unsigned bkt;
+
+    rcu_read_lock();
+    fibered_process_node = check_if_process_is_fibered((long)sfile->private);
+    if (fibered_process_node == NULL) goto out;
+    get_fibered_process_summary(fibered_process_node, &summary);
+    seq_printf(sfile, "%-30s : %u\n", "domains", summary.domains);
+    seq_printf(sfile, "%-30s : %u\n", "fibers", summary.fibers);
+    seq_printf(sfile, "%-30s : %u\n", "running fibers", summary.running);
+    // the counters are read without locks, a conversion can be seen half done
+    seq_printf(sfile, "%-30s : %u\n", "idle fibers",
+               summary.fibers > summary.running ? summary.fibers - summary.running : 0);
+    seq_printf(sfile, "%-30s : %lu\n", "switches", summary.switches);
+    seq_printf(sfile, "%-30s : %lu\n", "failed activations", summary.failed_activations);
+    list_for_each_entry_rcu(domain, &fibered_process_node->domains, list) {
+        hash_for_each_rcu(domain->threads, bkt, fibered_thread_node, hlist) {
+            seq_printf(sfile, "thread %-23d : %lu switches, running fiber %u\n",
+                       fibered_thread_node->pid, READ_ONCE(fibered_thread_node->switches),
+                       READ_ONCE(fibered_thread_node->running_fiber)->id);
+        }
+    }
+out:
+    rcu_read_unlock();
+    return 0;
+}
+
+/**
+ * @brief Open the `/proc/<PID>/fibers/latency` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int latency_proc_open(struct inode *inode, struct file *file) {
+    unsigned long pid;
+
+    // we are in /proc/<PID>/fibers/latency
+    if (kstrtoul(file->f_path.dentry->d_parent->d_parent->d_name.name, 10, &pid) != 0)
+        return -ENOENT;
+    return single_open(file, latency_proc_show, (void *)pid);
+}
+
+/**
+ * @brief Open the `/proc/fibers/<PID>/latency` file
+ *
+ * @param inode
+ * @param file
+ * @return int
+ */
+static int process_latency_proc_open(struct inode *inode, struct file *file) {
+    return single_open(file, latency_proc_show, PDE_DATA(inode));
+}
+
+/**
+ * @brief Show the histogram of the latency of the switches of a process
+ *
+ * # Implementation
+ * The histogram is the one kept by @ref switch_to_fiber and @ref switch_to_any_fiber, see
+ * @ref get_switch_latency, only the buckets that are not empty are shown, by their range of
+ * cycles. The switches are only counted while the statistics of their domain are enabled, see
+ * @ref set_stats_period, so the histogram stays empty while they are disabled. The percentiles are
+ * computed on the buckets, so they are the upper bound of the bucket where they fall, a power of 2.
+ *
+ * @param sfile
+ * @param v
+ * @return int
+ */
+static int latency_proc_show(struct seq_file *sfile, void *v) {
+    static const unsigned percentiles[] = {500, 900, 990, 999}; // per mille
+    fibered_process_node_t *fibered_process_node;
+    unsigned long buckets[FIBER_LATENCY_BUCKETS];
+    unsigned long total = 0, sum;
+    int i, j;
+
+    rcu_read_lock();
+    fibered_process_node = check_if_process_is_fibered((long)sfile->private);
+    if (fibered_process_node != NULL) get_switch_latency(fibered_process_node, buckets);
+    rcu_read_unlock();
+    if (fibered_process_node == NULL) return 0;
+
+    for (i = 0; i < FIBER_LATENCY_BUCKETS; i++) total += buckets[i];
+    seq_printf(sfile, "%-30s : %lu\n", "switches with statistics", total);
+    for (j = 0; j < ARRAY_SIZE(percentiles); j++) {
+        for (i = 0, sum = 0; i < FIBER_LATENCY_BUCKETS - 1; i++) {
+            sum += buckets[i];
+            if (sum * 1000 >= total * percentiles[j]) break;
+        }
+        seq_printf(sfile, "p%-29u : < %llu cycles\n", percentiles[j], 1ULL << i);
+    }
+    for (i = 0; i < FIBER_LATENCY_BUCKETS; i++) {
+        if (buckets[i] == 0) continue;
+        seq_printf(sfile, "[%llu, %llu) cycles : %lu\n", i == 0 ? 0 : 1ULL << (i - 1), 1ULL << i,
+                   buckets[i]);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Reset the histogram of the latency of the switches of a process, by writing anything to
+ * its file
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @param ppos
+ * @return ssize_t
+ */
+static ssize_t latency_proc_write(struct file *file, const char __user *buf, size_t count,
+                                  loff_t *ppos) {
+    fibered_process_node_t *fibered_process_node;
+
+    rcu_read_lock();
+    fibered_process_node =
+        check_if_process_is_fibered((long)((struct seq_file *)file->private_data)->private);
+    if (fibered_process_node != NULL) reset_switch_latency(fibered_process_node);
+    rcu_read_unlock();
+    return fibered_process_node != NULL ? count : -ESRCH;
+}